@@ -7,6 +7,13 @@ projenv.AddCustomTarget(
     dependencies=None,
     actions=[
         "$CXX -g -o correlator.S $CXXFLAGS $CCFLAGS -S -fverbose-asm lib/correlator/src/correlator.cpp",
+        "$CXX -g -o correlator_fft.S $CXXFLAGS $CCFLAGS -S -fverbose-asm lib/correlator/src/correlator_fft.cpp",
+        "$CXX -g -o fft.S $CXXFLAGS $CCFLAGS -S -fverbose-asm lib/correlator/src/fft.cpp",
+        "$CXX -g -o correlator_multires.S $CXXFLAGS $CCFLAGS -S -fverbose-asm lib/correlator/src/correlator_multires.cpp",
+        "$CXX -g -o binary.S $CXXFLAGS $CCFLAGS -S -fverbose-asm lib/correlator/src/binary.cpp",
+        "$CXX -g -o compact.S $CXXFLAGS $CCFLAGS -S -fverbose-asm lib/correlator/src/compact.cpp",
+        "$CXX -g -o correlator_parallel.S $CXXFLAGS $CCFLAGS -S -fverbose-asm lib/correlator/src/correlator_parallel.cpp",
+        "$CXX -g -o executor.S $CXXFLAGS $CCFLAGS -S -fverbose-asm lib/correlator/src/executor.cpp",
     ],
     title="Disassemble libcorrelator",
     description="Disassemble libcorrelator"
@@ -0,0 +1,136 @@
+#include "binary.h"
+
+using namespace correlator;
+
+
+#define likely(x)       __builtin_expect((x),1)
+#define unlikely(x)     __builtin_expect((x),0)
+
+#ifndef PLATFORM_NATIVE
+#define EXECUTE_FROM_RAM(subsection) __attribute__ ((long_call, section (".time_critical." subsection)))
+#else
+#define EXECUTE_FROM_RAM(subsection)
+#endif
+
+
+EXECUTE_FROM_RAM("cor")
+void BinaryCircularBuffer::write(const int16_t *buf, size_t length) {
+    size_t pos = m_data_ptr;
+    uint32_t word = m_data[pos / BINARY_WORD_BITS];
+    const int16_t threshold = m_threshold;
+
+    // Bits are collected in a register and stored once per word
+    while (length--) {
+        const uint32_t bit = 1UL << (pos % BINARY_WORD_BITS);
+        if (*buf++ >= threshold)
+            word |= bit;
+        else
+            word &= ~bit;
+
+        if (unlikely(++pos % BINARY_WORD_BITS == 0)) {
+            m_data[pos / BINARY_WORD_BITS - 1] = word;
+            if (pos == m_capacity)
+                pos = 0;
+            word = m_data[pos / BINARY_WORD_BITS];
+        }
+    }
+    m_data[pos / BINARY_WORD_BITS] = word;
+    m_data_ptr = pos;
+}
+
+uint32_t BinaryCircularBuffer::get_word(int start) const {
+    int pos = m_data_ptr + start; // start is < 0
+    if (pos < 0)
+        pos += m_capacity;
+
+    const size_t n_words = m_capacity / BINARY_WORD_BITS;
+    const size_t index = pos / BINARY_WORD_BITS;
+    const uint32_t shift = pos % BINARY_WORD_BITS;
+    if (!shift)
+        return m_data[index];
+    const size_t next = (index + 1 == n_words) ? 0 : index + 1;
+    return (m_data[index] >> shift) | (m_data[next] << (BINARY_WORD_BITS - shift));
+}
+
+// Counts common ones of `needle` words and `a` bits starting from bit `pos`
+EXECUTE_FROM_RAM("cor")
+static int64_t correlate_words(const uint32_t *data, size_t n_data_words, size_t pos,
+                               const uint32_t *needle, size_t n_words) {
+    size_t index = pos / BINARY_WORD_BITS;
+    const uint32_t shift = pos % BINARY_WORD_BITS;
+    uint32_t count{0};
+
+    if (!shift) {
+        while (n_words--) {
+            count += __builtin_popcount(data[index] & *needle++);
+            if (unlikely(++index == n_data_words))
+                index = 0;
+        }
+        return count;
+    }
+
+    // Unaligned: every word is made of two neighbours
+    uint32_t cur = data[index];
+    while (n_words--) {
+        if (unlikely(++index == n_data_words))
+            index = 0;
+        const uint32_t next = data[index];
+        const uint32_t word = (cur >> shift) | (next << (BINARY_WORD_BITS - shift));
+        count += __builtin_popcount(word & *needle++);
+        cur = next;
+    }
+    return count;
+}
+
+EXECUTE_FROM_RAM("cor")
+void correlator::correlate_binary(const BinaryCircularBuffer &a,
+                        const BinaryCircularBuffer &b,
+                        uint32_t a_offset_min,
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        correlator::correlate_callback_t &callback) {
+    const size_t n_words = (length + BINARY_WORD_BITS - 1) / BINARY_WORD_BITS;
+    const bool have_needle = length && (length <= b.get_capacity());
+    std::vector<uint32_t> needle(have_needle ? n_words : 0);
+
+    // Needle is aligned to words once, samples past its end are masked
+    for (size_t n = 0; n < needle.size(); n++)
+        needle[n] = b.get_word(-(int)length + n * BINARY_WORD_BITS);
+    if (have_needle && (length % BINARY_WORD_BITS))
+        needle[n_words - 1] &= (1UL << (length % BINARY_WORD_BITS)) - 1;
+
+    const size_t capacity = a.get_capacity();
+    for (uint32_t offset = a_offset_min; offset < a_offset_max; offset++) {
+        int64_t sum{0};
+        if (have_needle && (length + offset <= capacity)) {
+            size_t pos = (a.get_data_ptr() + capacity - length - offset) % capacity;
+            sum = correlate_words(a.get_data(), capacity / BINARY_WORD_BITS, pos,
+                                  needle.data(), n_words);
+        }
+        callback(offset, sum);
+    }
+}
+
+void correlator::correlate_binary_binned(const BinaryCircularBuffer &a,
+                        const BinaryCircularBuffer &b,
+                        uint32_t a_offset_min,
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        uint32_t bin_step,
+                        correlator::correlate_callback_t &callback) {
+    uint32_t bin_offset{a_offset_min};
+    int64_t bin_sum{0};
+
+    correlator::correlate_callback_t f([&](int32_t offset, int64_t sum) {
+        if (static_cast<uint32_t>(offset) >= bin_offset + bin_step) {
+            callback(bin_offset, bin_sum);
+            bin_offset += bin_step;
+            bin_sum = 0;
+        }
+        bin_sum += sum;
+    });
+    correlate_binary(a, b, a_offset_min, a_offset_max, length, f);
+
+    if (a_offset_max > a_offset_min)
+        callback(bin_offset, bin_sum);
+}
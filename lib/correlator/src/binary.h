@@ -0,0 +1,70 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include "correlator.h"
+
+namespace correlator {
+
+constexpr size_t BINARY_WORD_BITS{32};
+
+/*
+ * Circular buffer of thresholded samples, packed one bit per sample.
+ * Sample is stored as 1 when it is >= threshold. Bit n of word w holds
+ * sample w*32 + n. Capacity is rounded up to whole words.
+ */
+class BinaryCircularBuffer final {
+public:
+    BinaryCircularBuffer(size_t size, int16_t threshold) :
+        m_capacity{(size + BINARY_WORD_BITS - 1) & ~(BINARY_WORD_BITS - 1)},
+        m_threshold{threshold} {
+        m_data = new uint32_t[m_capacity / BINARY_WORD_BITS]{};
+    }
+
+    ~BinaryCircularBuffer() {
+        delete[] m_data;
+    }
+
+    const uint32_t *get_data() const { return m_data; }
+    size_t get_data_ptr() const { return m_data_ptr; }
+    size_t get_capacity() const { return m_capacity; }
+    int16_t get_threshold() const { return m_threshold; }
+
+    // Thresholds and stores samples
+    void write(const int16_t *buf, size_t length);
+    // Returns 32 samples starting from `start` (start < 0), first one in bit 0.
+    // Bits past the latest sample are undefined.
+    uint32_t get_word(int start) const;
+
+private:
+    uint32_t *m_data;
+    size_t    m_data_ptr{0};
+    size_t    m_capacity;
+    int16_t   m_threshold;
+};
+
+/*
+ * Performs correlation of binary buffers as correlate() does for sample buffers:
+ * the value for an offset is the number of samples which are 1 in both `b`
+ * (needle) and `a` (haystack). 32 samples are processed with one AND and popcount.
+ * Offsets without data in `a` get 0.
+ */
+void correlate_binary(const BinaryCircularBuffer &a,
+                const BinaryCircularBuffer &b,
+                uint32_t a_offset_min,
+                uint32_t a_offset_max,
+                uint32_t length,
+                correlate_callback_t &callback);
+
+/*
+ * Same as correlate_binary(), but returns sums of `bin_step` consecutive offsets,
+ * as correlate_binned() does.
+ */
+void correlate_binary_binned(const BinaryCircularBuffer &a,
+                const BinaryCircularBuffer &b,
+                uint32_t a_offset_min,
+                uint32_t a_offset_max,
+                uint32_t length,
+                uint32_t bin_step,
+                correlate_callback_t &callback);
+
+}
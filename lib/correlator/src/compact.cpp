@@ -0,0 +1,153 @@
+#include <algorithm>
+#include "compact.h"
+
+using namespace correlator;
+
+
+#define likely(x)       __builtin_expect((x),1)
+#define unlikely(x)     __builtin_expect((x),0)
+
+#ifndef PLATFORM_NATIVE
+#define EXECUTE_FROM_RAM(subsection) __attribute__ ((long_call, section (".time_critical." subsection)))
+#else
+#define EXECUTE_FROM_RAM(subsection)
+#endif
+
+constexpr size_t COMPACT_LAG_BLOCK{4};
+
+template <typename Format>
+CompactCircularBuffer<Format>::CompactCircularBuffer(size_t size, uint8_t shift) : m_shift{shift} {
+    size_t capacity{2};
+    while (capacity < size)
+        capacity <<= 1;
+    m_mask = capacity - 1;
+    // TODO throw something if it fails
+    m_data = new uint8_t[Format::bytes(capacity)]{};
+}
+
+template <typename Format>
+EXECUTE_FROM_RAM("cor")
+void CompactCircularBuffer<Format>::write(const int16_t *buf, size_t length) {
+    size_t pos = m_data_ptr;
+    while (length--) {
+        const int16_t v = *buf++ >> m_shift;
+        Format::store(m_data, pos, std::min(std::max(v, Format::MIN), Format::MAX));
+        pos = (pos + 1) & m_mask;
+    }
+    m_data_ptr = pos;
+}
+
+/*
+ * Correlates `length` samples of `b` from `ib` to `a` from `ia`,
+ * and to COMPACT_LAG_BLOCK - 1 next alignments of `a`:
+ *   sums[j] = sum(a[ia + n + j] * b[ib + n])
+ */
+template <typename Format>
+EXECUTE_FROM_RAM("cor")
+static void correlate_compact_block(const CompactCircularBuffer<Format> &a, size_t ia,
+                                    const CompactCircularBuffer<Format> &b, size_t ib,
+                                    uint32_t length, int64_t sums[COMPACT_LAG_BLOCK]) {
+    static_assert(COMPACT_LAG_BLOCK == 4, "kernel is written for 4 lags");
+    const uint8_t *pa = a.get_data();
+    const uint8_t *pb = b.get_data();
+    const size_t mask_a = a.get_mask();
+    const size_t mask_b = b.get_mask();
+
+    int32_t x0 = Format::load(pa, ia);
+    int32_t x1 = Format::load(pa, (ia + 1) & mask_a);
+    int32_t x2 = Format::load(pa, (ia + 2) & mask_a);
+    ia = (ia + 3) & mask_a;
+
+    for (uint32_t n = 0; n < length; ) {
+        // Batch ends before either position wraps
+        const uint32_t batch = std::min<size_t>(std::min<size_t>(Format::BATCH, length - n),
+                                                std::min(mask_a + 1 - ia, mask_b + 1 - ib));
+        int32_t s0{0}, s1{0}, s2{0}, s3{0};
+
+        // Window of 4 `a` samples rotates through registers
+        for (uint32_t k = 0; k < batch; k++) {
+            const int32_t x3 = Format::load(pa, ia + k);
+            const int32_t y = Format::load(pb, ib + k);
+            s0 += x0 * y;
+            s1 += x1 * y;
+            s2 += x2 * y;
+            s3 += x3 * y;
+            x0 = x1;
+            x1 = x2;
+            x2 = x3;
+        }
+        sums[0] += s0;
+        sums[1] += s1;
+        sums[2] += s2;
+        sums[3] += s3;
+        ia = (ia + batch) & mask_a;
+        ib = (ib + batch) & mask_b;
+        n += batch;
+    }
+}
+
+template <typename Format>
+EXECUTE_FROM_RAM("cor")
+static int64_t correlate_compact(const CompactCircularBuffer<Format> &a, size_t ia,
+                                 const CompactCircularBuffer<Format> &b, size_t ib,
+                                 uint32_t length) {
+    const uint8_t *pa = a.get_data();
+    const uint8_t *pb = b.get_data();
+    const size_t mask_a = a.get_mask();
+    const size_t mask_b = b.get_mask();
+    int64_t sum{0};
+
+    for (uint32_t n = 0; n < length; ) {
+        // Batch ends before either position wraps
+        const uint32_t batch = std::min<size_t>(std::min<size_t>(Format::BATCH, length - n),
+                                                std::min(mask_a + 1 - ia, mask_b + 1 - ib));
+        int32_t s{0};
+        for (uint32_t k = 0; k < batch; k++)
+            s += Format::load(pa, ia + k) * Format::load(pb, ib + k);
+        sum += s;
+        ia = (ia + batch) & mask_a;
+        ib = (ib + batch) & mask_b;
+        n += batch;
+    }
+    return sum;
+}
+
+template <typename Format>
+void correlator::correlate_into(const CompactCircularBuffer<Format> &a,
+                        const CompactCircularBuffer<Format> &b,
+                        uint32_t a_offset_min,
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        int64_t *out) {
+    const size_t capacity = a.get_capacity();
+    const bool have_needle = length && (length <= b.get_capacity());
+    const size_t ib = (b.get_data_ptr() - length) & b.get_mask();
+    // Position in `a` of the first needle sample at `offset`
+    auto start_a = [&](uint32_t offset) {
+        return (a.get_data_ptr() - length - offset) & a.get_mask();
+    };
+
+    uint32_t offset = a_offset_min;
+    // Adjacent offsets are calculated in blocks sharing sample loads
+    for (; have_needle && (offset + COMPACT_LAG_BLOCK <= a_offset_max) &&
+           (length + offset + COMPACT_LAG_BLOCK - 1 <= capacity); offset += COMPACT_LAG_BLOCK) {
+        int64_t sums[COMPACT_LAG_BLOCK]{};
+        correlate_compact_block(a, start_a(offset + COMPACT_LAG_BLOCK - 1), b, ib, length, sums);
+        for (size_t k = 0; k < COMPACT_LAG_BLOCK; k++)
+            out[offset - a_offset_min + k] = sums[COMPACT_LAG_BLOCK - 1 - k];
+    }
+
+    for (; offset < a_offset_max; offset++) {
+        int64_t sum{0};
+        if (have_needle && (length + offset <= capacity))
+            sum = correlate_compact(a, start_a(offset), b, ib, length);
+        out[offset - a_offset_min] = sum;
+    }
+}
+
+template class correlator::CompactCircularBuffer<Int8Format>;
+template class correlator::CompactCircularBuffer<Packed12Format>;
+template void correlator::correlate_into(const Int8CircularBuffer &, const Int8CircularBuffer &,
+                                         uint32_t, uint32_t, uint32_t, int64_t *);
+template void correlator::correlate_into(const Packed12CircularBuffer &, const Packed12CircularBuffer &,
+                                         uint32_t, uint32_t, uint32_t, int64_t *);
@@ -0,0 +1,101 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include "correlator.h"
+
+namespace correlator {
+
+/*
+ * Sample formats of CompactCircularBuffer. Each one defines the sample range,
+ * storage size, access to sample i of the storage, and how many products
+ * an int32 subsum holds.
+ */
+
+// One sample per byte
+struct Int8Format {
+    static constexpr int16_t MIN{-128};
+    static constexpr int16_t MAX{127};
+    static constexpr size_t  BATCH{1024};
+
+    static size_t bytes(size_t n) { return n; }
+    static int16_t load(const uint8_t *data, size_t i) { return static_cast<int8_t>(data[i]); }
+    static void store(uint8_t *data, size_t i, int16_t v) { data[i] = static_cast<uint8_t>(v); }
+};
+
+// Two samples per three bytes: even sample in byte 0 and low nibble of byte 1,
+// odd one in high nibble of byte 1 and byte 2
+struct Packed12Format {
+    static constexpr int16_t MIN{-2048};
+    static constexpr int16_t MAX{2047};
+    static constexpr size_t  BATCH{256};
+
+    static size_t bytes(size_t n) { return (n * 3 + 1) / 2; }
+    static int16_t load(const uint8_t *data, size_t i) {
+        const uint8_t *p = data + i + (i >> 1);
+        const uint16_t v = (i & 1) ? (p[0] >> 4) | (p[1] << 4) : p[0] | (p[1] << 8);
+        // Sign is extended from bit 11
+        return static_cast<int16_t>(v << 4) >> 4;
+    }
+    static void store(uint8_t *data, size_t i, int16_t v) {
+        uint8_t *p = data + i + (i >> 1);
+        if (i & 1) {
+            p[0] = (p[0] & 0x0f) | ((v << 4) & 0xf0);
+            p[1] = v >> 4;
+        } else {
+            p[0] = v;
+            p[1] = (p[1] & 0xf0) | ((v >> 8) & 0x0f);
+        }
+    }
+};
+
+/*
+ * Circular buffer keeping samples in a compact format.
+ * Samples are shifted right by `shift` and saturated to the format range
+ * when written. Capacity is rounded up to a power of two, positions wrap
+ * with a mask.
+ */
+template <typename Format>
+class CompactCircularBuffer final {
+public:
+    CompactCircularBuffer(size_t size, uint8_t shift = 0);
+    ~CompactCircularBuffer() {
+        delete[] m_data;
+    }
+
+    const uint8_t *get_data() const { return m_data; }
+    size_t get_data_ptr() const { return m_data_ptr; }
+    size_t get_capacity() const { return m_mask + 1; }
+    size_t get_mask() const { return m_mask; }
+    uint8_t get_shift() const { return m_shift; }
+    // Bytes used for samples
+    size_t get_storage_size() const { return Format::bytes(m_mask + 1); }
+
+    void write(const int16_t *buf, size_t length);
+    // Returns sample at `start` (-capacity <= start < 0), as stored
+    int16_t get(int start) const {
+        return Format::load(m_data, (m_data_ptr + start) & m_mask);
+    }
+
+private:
+    uint8_t *m_data;
+    size_t   m_data_ptr{0};
+    size_t   m_mask;
+    uint8_t  m_shift;
+};
+
+typedef CompactCircularBuffer<Int8Format> Int8CircularBuffer;
+typedef CompactCircularBuffer<Packed12Format> Packed12CircularBuffer;
+
+/*
+ * Performs correlation of compact buffers as correlate_into() does,
+ * on stored (shifted) sample values. Offsets without data in `a` get 0.
+ */
+template <typename Format>
+void correlate_into(const CompactCircularBuffer<Format> &a,
+                const CompactCircularBuffer<Format> &b,
+                uint32_t a_offset_min,
+                uint32_t a_offset_max,
+                uint32_t length,
+                int64_t *out);
+
+}
@@ -23,15 +23,72 @@ void CircularBuffer::write(const int16_t *buf, size_t length) {
         length = m_capacity;
     }
 
-    if (m_data_ptr + length > m_capacity) {
-        const size_t first_chunk = m_capacity - m_data_ptr;
-        std::memcpy(m_data + m_data_ptr, buf, first_chunk*sizeof(int16_t));
-        std::memcpy(m_data, buf + first_chunk, (length - first_chunk)*sizeof(int16_t));
-        m_data_ptr = (length - first_chunk);
-    } else {
-        std::memcpy(m_data + m_data_ptr, buf, length*sizeof(int16_t));
-        m_data_ptr += length;
-    }        
+    // At most two rounds, the second one after wrap
+    while (length) {
+        auto space = claim(length);
+        std::memcpy(space.start, buf, space.length*sizeof(int16_t));
+        commit(space.length);
+        buf += space.length;
+        length -= space.length;
+    }
+}
+
+processing_unit_t CircularBuffer::claim(size_t length) {
+    return {m_data + m_data_ptr, std::min(length, m_capacity - m_data_ptr)};
+}
+
+void CircularBuffer::commit(size_t length) {
+    if (m_mirrored)
+        std::memcpy(m_data + m_capacity + m_data_ptr, m_data + m_data_ptr, length*sizeof(int16_t));
+    update_summary(m_data_ptr, m_data_ptr + length);
+    m_data_ptr += length;
+    if (m_data_ptr == m_capacity)
+        m_data_ptr = 0;
+}
+
+CircularBufferView::CircularBufferView(const CircularBuffer &buf, int start, int length) {
+    m_n_chunks = buf.get_data_chunks_c(start, length, m_chunks);
+    m_length = m_n_chunks ? length : 0;
+}
+
+// Recalculates block maximums for blocks touched by [from, to) 
+void CircularBuffer::update_summary(size_t from, size_t to) {
+    if (from >= to)
+        return;
+    for (size_t block = from / SUMMARY_BLOCK_LEN; block <= (to - 1) / SUMMARY_BLOCK_LEN; block++) {
+        const size_t start = block * SUMMARY_BLOCK_LEN;
+        const size_t end = std::min(start + SUMMARY_BLOCK_LEN, m_capacity);
+        uint16_t max{0};
+        for (size_t n = start; n < end; n++)
+            max = std::max<uint16_t>(max, abs(m_data[n]));
+        m_block_max[block] = max;
+    }
+}
+
+uint16_t CircularBuffer::get_max(int start, int length) const {
+    processing_unit_t chunks[2];
+    size_t n_chunks = get_data_chunks_c(start, length, chunks);
+    uint16_t max{0};
+
+    for (size_t n = 0; n < n_chunks; n++) {
+        if (!chunks[n].length)
+            continue;
+        size_t from = chunks[n].start - m_data;
+        size_t to = from + chunks[n].length;
+        // Mirrored chunk may start in or cross into the copy
+        if (from >= m_capacity) {
+            from -= m_capacity;
+            to -= m_capacity;
+        }
+        if (to > m_capacity) {
+            for (size_t block = 0; block <= (to - m_capacity - 1) / SUMMARY_BLOCK_LEN; block++)
+                max = std::max(max, m_block_max[block]);
+            to = m_capacity;
+        }
+        for (size_t block = from / SUMMARY_BLOCK_LEN; block <= (to - 1) / SUMMARY_BLOCK_LEN; block++)
+            max = std::max(max, m_block_max[block]);
+    }
+    return max;
 }
 
 
@@ -47,7 +104,7 @@ std::vector<processing_unit_t> CircularBuffer::get_data_chunks(int start, int le
     if (ptr < 0)
         ptr += m_capacity;
 
-    if (ptr + length > m_capacity) {
+    if ((ptr + length > m_capacity) && !m_mirrored) {
         const size_t first_chunk = m_capacity - ptr;
         ret.push_back({m_data + ptr, first_chunk});
         ret.push_back({m_data, length - first_chunk});
@@ -69,7 +126,7 @@ size_t CircularBuffer::get_data_chunks_c(int start, int length, processing_unit_
     if (ptr < 0)
         ptr += m_capacity;
 
-    if (ptr + length > m_capacity) {
+    if ((ptr + length > m_capacity) && !m_mirrored) {
         const size_t first_chunk = m_capacity - ptr;
         out[0] = {m_data + ptr, first_chunk};
         out[1] = {m_data, length - first_chunk};
@@ -97,6 +154,10 @@ static size_t break_chunks_a(const CircularBuffer &a, int start_a,
     int b_len{0};
     size_t n_out = 0;
 
+    // a shall have all the data, otherwise later needle chunks would get pairs
+    if (start_a < -(int)a.get_capacity())
+        return 0;
+
     for (size_t n_b = 0; n_b < n_chunks_b; n_b++) {
         const auto *bc{&chunks_b[n_b]};
 
@@ -189,47 +250,188 @@ static int64_t correlate_pair(const processing_pair_t& p) {
     return sum;
 }
 
+constexpr size_t LAG_BLOCK{4};
+
+/*
+ * Correlates pair data at LAG_BLOCK adjacent alignments of `a`:
+ *   sums[j] += sum(pa[n + j] * pb[n])
+ * Each needle sample is loaded once and used for all alignments.
+ * `a` samples past the end of the pair are read from the circular
+ * buffer `a_data` of `a_capacity`, as the pair may end at its wrap point.
+ */
 EXECUTE_FROM_RAM("cor")
-void correlator::correlate(const CircularBuffer &a,
+static void correlate_pair_block(const processing_pair_t& p,
+                                 const int16_t *a_data, size_t a_capacity,
+                                 int64_t sums[LAG_BLOCK]) {
+    static_assert(LAG_BLOCK == 4, "kernel is written for 4 lags");
+    const int16_t *pa{p.a.start};
+    const int16_t *pb{p.b.start};
+    constexpr size_t batch_size{16};
+    const size_t len{p.a.length};
+    // Samples for which all alignments are within the pair
+    size_t body{len > LAG_BLOCK - 1 ? len - (LAG_BLOCK - 1) : 0};
+    size_t n{0};
+
+    if (likely(body > 0)) {
+        int32_t x0 = pa[0];
+        int32_t x1 = pa[1];
+        int32_t x2 = pa[2];
+
+        while (likely(n < body)) {
+            // With values not exceeding 13 bits, we can add 
+            // up to 64 products without overflowing
+            const size_t batch = std::min(batch_size, body - n);
+            int32_t s0{0}, s1{0}, s2{0}, s3{0};
+
+            // Window of 4 `a` samples rotates through registers
+            #pragma GCC unroll 16
+            for (size_t k = 0; k < batch; k++) {
+                const int32_t x3 = pa[n + k + 3];
+                const int32_t y = pb[n + k];
+                s0 += x0 * y;
+                s1 += x1 * y;
+                s2 += x2 * y;
+                s3 += x3 * y;
+                x0 = x1;
+                x1 = x2;
+                x2 = x3;
+            }
+            sums[0] += s0;
+            sums[1] += s1;
+            sums[2] += s2;
+            sums[3] += s3;
+            n += batch;
+        }
+    }
+
+    // Last samples may need `a` data past the pair
+    const size_t pos = pa - a_data;
+    for (; n < len; n++) {
+        for (size_t j = 0; j < LAG_BLOCK; j++) {
+            size_t idx = pos + n + j;
+            if (idx >= a_capacity)
+                idx -= a_capacity;
+            sums[j] += a_data[idx] * pb[n];
+        }
+    }
+}
+
+/*
+ * Correlates needle chunks to `a` at LAG_BLOCK offsets, `start_a` being 
+ * the start for the smallest one. Fills sums in ascending offset order.
+ */
+EXECUTE_FROM_RAM("cor")
+static void correlate_lag_block(const CircularBuffer &a, int start_a,
+                                const processing_unit_t chunks_b[2], size_t n_chunks_b,
+                                int64_t sums[LAG_BLOCK]) {
+    processing_pair_t pairs[4];
+    // Pairs are made for the largest offset, others read further into `a`
+    size_t n_pairs = break_chunks_a(a, start_a - (LAG_BLOCK - 1),
+                                    chunks_b, n_chunks_b, pairs);
+
+    if (likely(n_pairs)) {
+        int64_t block[LAG_BLOCK]{};
+        for (size_t n = 0; n < n_pairs; n++)
+            correlate_pair_block(pairs[n], a.get_data(), a.get_capacity(), block);
+        for (size_t k = 0; k < LAG_BLOCK; k++)
+            sums[k] = block[LAG_BLOCK - 1 - k];
+        return;
+    }
+
+    // Largest offset is out of data, others may be not
+    for (size_t k = 0; k < LAG_BLOCK; k++) {
+        n_pairs = break_chunks_a(a, start_a - k, chunks_b, n_chunks_b, pairs);
+        sums[k] = 0;
+        for (size_t n = 0; n < n_pairs; n++)
+            sums[k] += correlate_pair(pairs[n]);
+    }
+}
+
+/*
+ * correlate_into() for mirrored buffers having data for all offsets:
+ * each offset is a single pair of windows, no chunks are made
+ */
+EXECUTE_FROM_RAM("cor")
+static void correlate_mirrored(const CircularBuffer &a, const CircularBuffer &b,
+                               uint32_t a_offset_min, uint32_t a_offset_max,
+                               uint32_t length, int64_t *out) {
+    processing_pair_t pair;
+    pair.a.length = length;
+    pair.b = {const_cast<int16_t *>(b.get_window(-(int)length)), length};
+    // Windows never reach the end of the copy, kernel does not wrap
+    const size_t a_span = 2 * a.get_capacity();
+
+    uint32_t offset = a_offset_min;
+    for (; offset + LAG_BLOCK <= a_offset_max; offset += LAG_BLOCK) {
+        // Window is taken for the largest offset, others read further into `a`
+        pair.a.start = const_cast<int16_t *>(a.get_window(-(int)(length + offset + LAG_BLOCK - 1)));
+        int64_t block[LAG_BLOCK]{};
+        correlate_pair_block(pair, a.get_data(), a_span, block);
+        for (size_t k = 0; k < LAG_BLOCK; k++)
+            out[offset - a_offset_min + k] = block[LAG_BLOCK - 1 - k];
+    }
+
+    for (; offset < a_offset_max; offset++) {
+        pair.a.start = const_cast<int16_t *>(a.get_window(-(int)(length + offset)));
+        out[offset - a_offset_min] = correlate_pair(pair);
+    }
+}
+
+EXECUTE_FROM_RAM("cor")
+void correlator::correlate_into(const CircularBuffer &a,
                         const CircularBuffer &b,
                         uint32_t a_offset_min, 
                         uint32_t a_offset_max,
                         uint32_t length,
-                        correlator::correlate_callback_t &callback) {
-    int32_t max_index{0};
-    int64_t max_val{0};
-    uint64_t time_chunks{0};
-    uint64_t time_correlate{0};
-    uint64_t n_correlations{0};
+                        int64_t *out,
+                        correlator::correlate_engine_t engine) {
+    if (engine == CORRELATE_AUTO)
+        engine = correlate_select_engine(a_offset_max - a_offset_min, length);
+    if (engine == CORRELATE_FFT) {
+        correlator::correlate_callback_t f([out, a_offset_min](int32_t offset, int64_t sum) {
+            out[offset - a_offset_min] = sum;
+        });
+        // FFT engine refuses lag ranges it cannot cover, those run in time domain
+        if (correlate_fft(a, b, a_offset_min, a_offset_max, length, f))
+            return;
+    }
+
+    if (a.is_mirrored() && b.is_mirrored() && length && (length <= b.get_capacity()) &&
+        (length + a_offset_max - 1 <= a.get_capacity())) {
+        correlate_mirrored(a, b, a_offset_min, a_offset_max, length, out);
+        return;
+    }
+
     processing_unit_t chunks_b[2];
     processing_pair_t pairs[4];
     const int start_b = -length;
 
-    // auto start_c{time_us_64()};
     size_t n_chunks_b = break_chunks_b(b, start_b, length, chunks_b);
-    // time_chunks += time_us_64() - start_c;
 
-    for (int offset = a_offset_min; offset < a_offset_max; offset++) {
-        int start_a = -length - offset;
+    int offset = a_offset_min;
+    // Adjacent offsets are calculated in blocks sharing sample loads
+    for (; offset + (int)LAG_BLOCK <= (int)a_offset_max; offset += LAG_BLOCK)
+        correlate_lag_block(a, -length - offset, chunks_b, n_chunks_b, out + (offset - a_offset_min));
 
-        // auto start_c{time_us_64()};
+    for (; offset < (int)a_offset_max; offset++) {
+        int start_a = -length - offset;
         size_t n_pairs = break_chunks_a(a, start_a, 
                             chunks_b, n_chunks_b, pairs);
-        // time_chunks += time_us_64() - start_c;
-
         int64_t sum{0};
-        // auto start_p{time_us_64()};
-        for (size_t n = 0; n < n_pairs; n++) {
+        for (size_t n = 0; n < n_pairs; n++)
             sum += correlate_pair(pairs[n]);
-            n_correlations += pairs[n].a.length;
-        }
-        // time_correlate += time_us_64() - start_p;
-        callback(offset, sum);
+        out[offset - a_offset_min] = sum;
     }
+}
 
-    // cli_info("chunks %llu", time_chunks);
-    // cli_info("correlate_pair %llu", time_correlate);
-    // cli_info("correlate_len %llu", n_correlations);
+void correlator::correlate(const CircularBuffer &a,
+                        const CircularBuffer &b,
+                        uint32_t a_offset_min, 
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        correlator::correlate_callback_t &callback,
+                        correlator::correlate_engine_t engine) {
+    correlate<correlate_callback_t &>(a, b, a_offset_min, a_offset_max, length, callback, engine);
 }
 
 std::pair<int32_t, int64_t> 
@@ -241,14 +443,680 @@ correlator::correlate_max(const CircularBuffer &a,
     int32_t max_index{0};
     int64_t max_val{0};
 
-    correlator::correlate_callback_t f([&](int32_t offset, int64_t sum) {
+    correlate(a, b, a_offset_min, a_offset_max, length, [&](int32_t offset, int64_t sum) {
         if (sum > max_val) {
             max_val = sum;
             max_index = offset;
         }
-    }); 
+    }, CORRELATE_DIRECT);
+
+    return std::make_pair(max_index, max_val);
+}
+
+
+// Correlates `length` samples of `b` starting at `start_b` to `a`, `offset` back
+static int64_t correlate_window(const CircularBuffer &a, const CircularBuffer &b,
+                                int start_b, int offset, int length) {
+    processing_pair_t pairs[4];
+    size_t n_pairs = break_chunks(a, b, start_b - offset, start_b, length, pairs);
+    int64_t sum{0};
+    for (size_t n = 0; n < n_pairs; n++)
+        sum += correlate_pair(pairs[n]);
+    return sum;
+}
+
+SlidingCorrelator::SlidingCorrelator(const CircularBuffer &a,
+                                     const CircularBuffer &b,
+                                     uint32_t a_offset_min,
+                                     uint32_t a_offset_max,
+                                     uint32_t length) :
+    m_a{a}, m_b{b}, m_offset_min{a_offset_min}, m_offset_max{a_offset_max},
+    m_length{length}, m_sums(a_offset_max - a_offset_min) {
+    reset();
+}
+
+void SlidingCorrelator::reset() {
+    correlator::correlate_callback_t f([&](int32_t offset, int64_t sum) {
+        m_sums[offset - m_offset_min] = sum;
+    });
+    correlate(m_a, m_b, m_offset_min, m_offset_max, m_length, f, CORRELATE_DIRECT);
+}
+
+EXECUTE_FROM_RAM("cor")
+void SlidingCorrelator::update(size_t n) {
+    m_written += n;
+
+    // Products leaving the window must still be in the buffers
+    if ((m_length + m_offset_max + n > m_a.get_capacity()) ||
+        (m_length + n > m_b.get_capacity())) {
+        reset();
+        return;
+    }
+
+    const int start_in = -(int)n;
+    const int start_out = -(int)(n + m_length);
+    int64_t *sums = m_sums.data();
+    processing_unit_t chunks_in[2];
+    processing_unit_t chunks_out[2];
+    size_t n_chunks_in = break_chunks_b(m_b, start_in, n, chunks_in);
+    size_t n_chunks_out = break_chunks_b(m_b, start_out, n, chunks_out);
+
+    uint32_t offset = m_offset_min;
+    for (; offset + LAG_BLOCK <= m_offset_max; offset += LAG_BLOCK) {
+        int64_t sums_in[LAG_BLOCK];
+        int64_t sums_out[LAG_BLOCK];
+        correlate_lag_block(m_a, start_in - offset, chunks_in, n_chunks_in, sums_in);
+        correlate_lag_block(m_a, start_out - offset, chunks_out, n_chunks_out, sums_out);
+        for (size_t k = 0; k < LAG_BLOCK; k++)
+            *sums++ += sums_in[k] - sums_out[k];
+    }
+
+    for (; offset < m_offset_max; offset++) {
+        int64_t delta = correlate_window(m_a, m_b, start_in, offset, n) -
+                        correlate_window(m_a, m_b, start_out, offset, n);
+        *sums++ += delta;
+    }
+}
+
+void SlidingCorrelator::get_all(correlate_callback_t &callback) const {
+    for (uint32_t offset = m_offset_min; offset < m_offset_max; offset++)
+        callback(offset, m_sums[offset - m_offset_min]);
+}
+
+// Offsets per fused kernel pass
+constexpr size_t FUSED_LAG_BLOCK{4};
+
+/*
+ * Correlates a pair made in `a` for FUSED_LAG_BLOCK adjacent offsets, and the
+ * same region of `b`, which holds its samples at the same positions:
+ *   aa[j] += sum(ha[n + j] * na[n]), ab[j] += sum(ha[n + j] * nb[n]),
+ *   bb[j] += sum(hb[n + j] * nb[n])
+ * where h is the haystack and n the needle part of the pair.
+ */
+template <bool with_bb>
+EXECUTE_FROM_RAM("cor")
+static void correlate_fused_pair(const processing_pair_t& p,
+                                 const int16_t *a_data, const int16_t *b_data, size_t capacity,
+                                 int64_t aa[FUSED_LAG_BLOCK], int64_t ab[FUSED_LAG_BLOCK],
+                                 int64_t bb[FUSED_LAG_BLOCK]) {
+    static_assert(FUSED_LAG_BLOCK == 4, "kernel is written for 4 lags");
+    const size_t ih = p.a.start - a_data;
+    const size_t in = p.b.start - a_data;
+    const int16_t *ha{a_data + ih};
+    const int16_t *hb{b_data + ih};
+    const int16_t *na{a_data + in};
+    const int16_t *nb{b_data + in};
+    constexpr size_t batch_size{16};
+    const size_t len{p.a.length};
+    // Samples for which all alignments are within the pair
+    const size_t body{len > FUSED_LAG_BLOCK - 1 ? len - (FUSED_LAG_BLOCK - 1) : 0};
+    size_t n{0};
+
+    if (likely(body > 0)) {
+        int32_t x0 = ha[0], x1 = ha[1], x2 = ha[2];
+        int32_t z0 = hb[0], z1 = hb[1], z2 = hb[2];
+
+        while (likely(n < body)) {
+            const size_t batch = std::min(batch_size, body - n);
+            int32_t aa0{0}, aa1{0}, aa2{0}, aa3{0};
+            int32_t ab0{0}, ab1{0}, ab2{0}, ab3{0};
+            int32_t bb0{0}, bb1{0}, bb2{0}, bb3{0};
+
+            // Windows of 4 haystack samples rotate through registers
+            for (size_t k = 0; k < batch; k++) {
+                const int32_t x3 = ha[n + k + 3];
+                const int32_t ya = na[n + k];
+                const int32_t yb = nb[n + k];
+                aa0 += x0 * ya;
+                aa1 += x1 * ya;
+                aa2 += x2 * ya;
+                aa3 += x3 * ya;
+                ab0 += x0 * yb;
+                ab1 += x1 * yb;
+                ab2 += x2 * yb;
+                ab3 += x3 * yb;
+                x0 = x1;
+                x1 = x2;
+                x2 = x3;
+                if (with_bb) {
+                    const int32_t z3 = hb[n + k + 3];
+                    bb0 += z0 * yb;
+                    bb1 += z1 * yb;
+                    bb2 += z2 * yb;
+                    bb3 += z3 * yb;
+                    z0 = z1;
+                    z1 = z2;
+                    z2 = z3;
+                }
+            }
+            aa[0] += aa0; aa[1] += aa1; aa[2] += aa2; aa[3] += aa3;
+            ab[0] += ab0; ab[1] += ab1; ab[2] += ab2; ab[3] += ab3;
+            if (with_bb) {
+                bb[0] += bb0; bb[1] += bb1; bb[2] += bb2; bb[3] += bb3;
+            }
+            n += batch;
+        }
+    }
+
+    // Last samples need haystack data past the pair
+    for (; n < len; n++) {
+        for (size_t j = 0; j < FUSED_LAG_BLOCK; j++) {
+            size_t idx = ih + n + j;
+            if (idx >= capacity)
+                idx -= capacity;
+            aa[j] += a_data[idx] * na[n];
+            ab[j] += a_data[idx] * nb[n];
+            if (with_bb)
+                bb[j] += b_data[idx] * nb[n];
+        }
+    }
+}
+
+template <bool with_bb>
+EXECUTE_FROM_RAM("cor")
+static void correlate_fused_lockstep(const CircularBuffer &a, const CircularBuffer &b,
+                                     uint32_t a_offset_min, uint32_t a_offset_max,
+                                     uint32_t length,
+                                     int64_t *out_aa, int64_t *out_ab, int64_t *out_bb) {
+    processing_unit_t chunks[2];
+    processing_pair_t pairs[4];
+    // Needle chunks are made in `a`, `b` samples are at the same positions
+    const size_t n_chunks = break_chunks_b(a, -(int)length, length, chunks);
+
+    for (uint32_t offset = a_offset_min; offset < a_offset_max; offset += FUSED_LAG_BLOCK) {
+        const size_t n_offsets = std::min<size_t>(FUSED_LAG_BLOCK, a_offset_max - offset);
+        // Pairs are made for the largest offset, others read further into `a`
+        size_t n_pairs = break_chunks_a(a, -(int)(length + offset + FUSED_LAG_BLOCK - 1),
+                                        chunks, n_chunks, pairs);
+        const size_t base = offset - a_offset_min;
+
+        if (likely(n_pairs && (n_offsets == FUSED_LAG_BLOCK))) {
+            int64_t aa[FUSED_LAG_BLOCK]{}, ab[FUSED_LAG_BLOCK]{}, bb[FUSED_LAG_BLOCK]{};
+            for (size_t n = 0; n < n_pairs; n++)
+                correlate_fused_pair<with_bb>(pairs[n], a.get_data(), b.get_data(),
+                                              a.get_capacity(), aa, ab, bb);
+            for (size_t k = 0; k < FUSED_LAG_BLOCK; k++) {
+                out_aa[base + k] = aa[FUSED_LAG_BLOCK - 1 - k];
+                out_ab[base + k] = ab[FUSED_LAG_BLOCK - 1 - k];
+                if (with_bb)
+                    out_bb[base + k] = bb[FUSED_LAG_BLOCK - 1 - k];
+            }
+            continue;
+        }
+
+        // Last offsets of the range, or offsets out of data
+        for (size_t k = 0; k < n_offsets; k++) {
+            out_aa[base + k] = correlate_window(a, a, -(int)length, offset + k, length);
+            out_ab[base + k] = correlate_window(a, b, -(int)length, offset + k, length);
+            if (with_bb)
+                out_bb[base + k] = correlate_window(b, b, -(int)length, offset + k, length);
+        }
+    }
+}
+
+EXECUTE_FROM_RAM("cor")
+void correlator::correlate_fused_into(const CircularBuffer &a,
+                        const CircularBuffer &b,
+                        uint32_t a_offset_min, 
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        int64_t *out_aa,
+                        int64_t *out_ab,
+                        int64_t *out_bb) {
+    const bool lockstep = (a.get_capacity() == b.get_capacity()) &&
+                          (a.get_data_ptr() == b.get_data_ptr()) &&
+                          (a.is_mirrored() == b.is_mirrored());
+    if (!lockstep) {
+        correlate_into(a, a, a_offset_min, a_offset_max, length, out_aa, CORRELATE_DIRECT);
+        correlate_into(a, b, a_offset_min, a_offset_max, length, out_ab, CORRELATE_DIRECT);
+        if (out_bb)
+            correlate_into(b, b, a_offset_min, a_offset_max, length, out_bb, CORRELATE_DIRECT);
+        return;
+    }
+
+    if (out_bb)
+        correlate_fused_lockstep<true>(a, b, a_offset_min, a_offset_max, length, out_aa, out_ab, out_bb);
+    else
+        correlate_fused_lockstep<false>(a, b, a_offset_min, a_offset_max, length, out_aa, out_ab, nullptr);
+}
+
+// Returns pointer to sample `pos` of a region split into chunks
+static inline const int16_t *chunk_ptr(const processing_unit_t chunks[2], size_t pos) {
+    if (pos < chunks[0].length)
+        return chunks[0].start + pos;
+    return chunks[1].start + (pos - chunks[0].length);
+}
+
+// Returns position of the next chunk boundary after `pos`
+static inline size_t chunk_end(const processing_unit_t chunks[2], size_t pos, size_t length) {
+    if (pos < chunks[0].length)
+        return chunks[0].length;
+    return length;
+}
+
+/*
+ * Correlates `length` samples of `b` to `bin_step` moving sum of `a`,
+ * which equals the sum of correlations at offsets [offset, offset + bin_step).
+ * With `with_b2`, needle of `b2` is correlated to the same moving sum into `result2`.
+ * Needles end `delay` samples before the latest sample.
+ * Returns false if `a` has no data for the whole bin.
+ */
+template <bool with_b2>
+EXECUTE_FROM_RAM("cor")
+static bool correlate_bin(const CircularBuffer &a, const CircularBuffer &b,
+                          const CircularBuffer *b2,
+                          uint32_t offset, uint32_t length, uint32_t bin_step,
+                          int64_t &result, int64_t &result2, uint32_t delay = 0) {
+    // moving_sum[n] = a[i0 + n] + ... + a[i0 + n - bin_step + 1]
+    const int start_b = -(int)(length + delay);
+    const int i0 = start_b - (int)offset;
+    processing_unit_t init[2], head[2], tail[2], needle[2], needle2[2];
+
+    if ((length < 1) || (i0 + 1 > 0))
+        return false;
+    const size_t n_init = a.get_data_chunks_c(i0 - bin_step + 1, bin_step, init);
+    if (!n_init ||
+        !a.get_data_chunks_c(i0 + 1, length - 1, head) ||
+        !a.get_data_chunks_c(i0 - bin_step + 1, length - 1, tail) ||
+        !b.get_data_chunks_c(start_b, length, needle))
+        return false;
+    if (with_b2 && !b2->get_data_chunks_c(start_b, length, needle2))
+        return false;
+
+    int32_t moving_sum{0};
+    for (size_t n = 0; n < n_init; n++)
+        for (size_t m = 0; m < init[n].length; m++)
+            moving_sum += init[n].start[m];
+
+    int64_t sum = needle[0].start[0] * moving_sum;
+    int64_t sum2 = with_b2 ? needle2[0].start[0] * moving_sum : 0;
+
+    // Walk the streams, splitting at every chunk boundary
+    size_t pos{1};
+    while (pos < length) {
+        size_t end = chunk_end(needle, pos, length);
+        end = std::min(end, chunk_end(head, pos - 1, length - 1) + 1);
+        end = std::min(end, chunk_end(tail, pos - 1, length - 1) + 1);
+        if (with_b2)
+            end = std::min(end, chunk_end(needle2, pos, length));
+
+        const int16_t *pb = chunk_ptr(needle, pos);
+        const int16_t *pb2 = with_b2 ? chunk_ptr(needle2, pos) : nullptr;
+        const int16_t *ph = chunk_ptr(head, pos - 1);
+        const int16_t *pt = chunk_ptr(tail, pos - 1);
+        for (size_t n = end - pos; n > 0; n--) {
+            moving_sum += *ph++ - *pt++;
+            sum += *pb++ * moving_sum;
+            if (with_b2)
+                sum2 += *pb2++ * moving_sum;
+        }
+        pos = end;
+    }
 
-    correlate(a, b, a_offset_min, a_offset_max, length, f);
+    result = sum;
+    result2 = sum2;
+    return true;
+}
+
+// Returns sum of correlations at `n_offsets` offsets starting from `offset`,
+// for the needle ending `delay` samples before the latest sample
+static int64_t bin_sum(const CircularBuffer &a, const CircularBuffer &b,
+                       uint32_t offset, uint32_t length, uint32_t n_offsets,
+                       uint32_t delay = 0) {
+    int64_t sum{0}, unused;
+    if (!correlate_bin<false>(a, b, nullptr, offset, length, n_offsets, sum, unused, delay)) {
+        // Some offsets have no data, sum up the ones which have it
+        sum = 0;
+        for (uint32_t n = 0; n < n_offsets; n++)
+            sum += correlate_window(a, b, -(int)(length + delay), offset + n, length);
+    }
+    return sum;
+}
+
+EXECUTE_FROM_RAM("cor")
+void correlator::correlate_binned(const CircularBuffer &a,
+                        const CircularBuffer &b,
+                        uint32_t a_offset_min, 
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        uint32_t bin_step,
+                        correlator::correlate_callback_t &callback) {
+    for (uint32_t offset = a_offset_min; offset < a_offset_max; offset += bin_step) {
+        const uint32_t n_offsets = std::min(bin_step, a_offset_max - offset);
+        callback(offset, bin_sum(a, b, offset, length, n_offsets));
+    }
+}
+
+EXECUTE_FROM_RAM("cor")
+void correlator::correlate_binned_into(const CircularBuffer &a,
+                        const CircularBuffer &b,
+                        uint32_t a_offset_min, 
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        uint32_t bin_step,
+                        int64_t *out) {
+    for (uint32_t offset = a_offset_min; offset < a_offset_max; offset += bin_step) {
+        const uint32_t n_offsets = std::min(bin_step, a_offset_max - offset);
+        *out++ = bin_sum(a, b, offset, length, n_offsets);
+    }
+}
+
+typedef struct {
+    int start;          // start in b (<0)
+    int length;
+    uint16_t max;       // magnitude bound of the run samples
+} sparse_run_t;
+
+/*
+ * Splits the needle into runs of adjacent blocks reaching `threshold`.
+ * Returns sum of length * magnitude bound over skipped blocks
+ */
+static int64_t sparse_runs(const CircularBuffer &b, uint32_t length, uint16_t threshold,
+                           std::vector<sparse_run_t> &runs) {
+    processing_unit_t chunks[2];
+    size_t n_chunks = break_chunks_b(b, -(int)length, length, chunks);
+    int64_t skipped{0};
+    int pos = -(int)length;
+
+    for (size_t n = 0; n < n_chunks; n++) {
+        size_t from = chunks[n].start - b.get_data();
+        const size_t to = from + chunks[n].length;
+        // Blocks are aligned to buffer storage, as the summary is
+        while (from < to) {
+            const int len = std::min(to, (from / SUMMARY_BLOCK_LEN + 1) * SUMMARY_BLOCK_LEN) - from;
+            const uint16_t max = b.get_max(pos, len);
+
+            if (max < threshold) {
+                skipped += (int64_t)len * max;
+            } else if (!runs.empty() && (runs.back().start + runs.back().length == pos)) {
+                runs.back().length += len;
+                runs.back().max = std::max(runs.back().max, max);
+            } else {
+                runs.push_back({pos, len, max});
+            }
+            pos += len;
+            from += len;
+        }
+    }
+    return skipped;
+}
+
+EXECUTE_FROM_RAM("cor")
+int64_t correlator::correlate_sparse(const CircularBuffer &a,
+                        const CircularBuffer &b,
+                        uint32_t a_offset_min, 
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        uint16_t threshold,
+                        correlator::correlate_callback_t &callback) {
+    std::vector<sparse_run_t> runs;
+    const int64_t skipped = sparse_runs(b, length, threshold, runs);
+    const size_t capacity = a.get_capacity();
+    const int span = std::min<size_t>(length + a_offset_max, capacity);
+    // Skipped needle blocks may meet any haystack sample
+    const int64_t skipped_error = skipped * a.get_max(-span, span);
+    int64_t max_error{0};
+
+    for (uint32_t offset = a_offset_min; offset < a_offset_max; offset += LAG_BLOCK) {
+        const uint32_t n_offsets = std::min<uint32_t>(LAG_BLOCK, a_offset_max - offset);
+        int64_t sums[LAG_BLOCK]{};
+        int64_t error{skipped_error};
+
+        for (const auto &run: runs) {
+            // Haystack span seen by the run at all offsets of the block, clamped
+            // to the capacity: get_max() of a span past it would be 0
+            const int span_start = std::max(run.start - (int)offset - (int)(n_offsets - 1),
+                                            -(int)capacity);
+            const int span_length = run.start + run.length - (int)offset - span_start;
+            const uint16_t max = (span_length > 0) ? a.get_max(span_start, span_length) : 0;
+            if (max < threshold) {
+                error += (int64_t)run.length * run.max * max;
+                continue;
+            }
+
+            if (likely(n_offsets == LAG_BLOCK)) {
+                processing_unit_t chunks_b[2];
+                size_t n_chunks_b = break_chunks_b(b, run.start, run.length, chunks_b);
+                int64_t block[LAG_BLOCK];
+                correlate_lag_block(a, run.start - offset, chunks_b, n_chunks_b, block);
+                for (size_t k = 0; k < LAG_BLOCK; k++)
+                    sums[k] += block[k];
+            } else {
+                for (size_t k = 0; k < n_offsets; k++)
+                    sums[k] += correlate_window(a, b, run.start, offset + k, run.length);
+            }
+        }
+
+        for (size_t k = 0; k < n_offsets; k++) {
+            // Runs may have data for offsets the whole window has not
+            if (length + offset + k > capacity)
+                sums[k] = 0;
+            callback(offset + k, sums[k]);
+        }
+        max_error = std::max(max_error, error);
+    }
+    return max_error;
+}
+
+uint32_t correlator::active_window_length(const CircularBuffer &buf,
+                        uint32_t min_length,
+                        uint32_t max_length,
+                        uint16_t threshold,
+                        uint32_t target_blocks) {
+    max_length = std::min<uint32_t>(max_length, buf.get_capacity());
+    min_length = std::min(min_length, max_length);
+
+    // Blocks are walked back from the latest sample using the summary only
+    uint32_t active{0};
+    uint32_t length{0};
+    while (length + SUMMARY_BLOCK_LEN <= max_length) {
+        length += SUMMARY_BLOCK_LEN;
+        if (buf.get_max(-(int)length, SUMMARY_BLOCK_LEN) >= threshold)
+            active++;
+        if (active >= target_blocks)
+            return std::max(length, min_length);
+    }
+    return max_length;
+}
+
+// Needle samples accumulated between bound checks
+constexpr size_t BOUND_SEGMENT_LEN{128};
+
+/*
+ * Fills `out` with sums of squares of the first 0, step, 2*step... samples
+ * of the region of `length` starting at `start`, last entry is for the whole region
+ */
+static void prefix_energy(const CircularBuffer &buf, int start, int length, size_t step,
+                          std::vector<int64_t> &out) {
+    processing_unit_t chunks[2];
+    size_t n_chunks = buf.get_data_chunks_c(start, length, chunks);
+    int64_t energy{0};
+    size_t count{0};
+
+    out.assign(1, 0);
+    for (size_t n = 0; n < n_chunks; n++) {
+        const int16_t *p = chunks[n].start;
+        for (size_t k = 0; k < chunks[n].length; k++) {
+            energy += p[k] * p[k];
+            if (++count % step == 0)
+                out.push_back(energy);
+        }
+    }
+    if (count % step)
+        out.push_back(energy);
+}
+
+// True when sum + sqrt(energy_a * energy_b) < best, with margin for float rounding
+static inline bool below_bound(int64_t sum, int64_t best, int64_t energy_a, int64_t energy_b) {
+    if (sum >= best)
+        return false;
+    const float d = best - sum;
+    return d * d > (float)energy_a * (float)energy_b * 1.001f;
+}
+
+std::pair<int32_t, int64_t> 
+correlator::correlate_max_bounded(const CircularBuffer &a,
+                        const CircularBuffer &b,
+                        uint32_t a_offset_min, 
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        int32_t hint) {
+    int32_t max_index{0};
+    int64_t max_val{0};
+    const size_t capacity = a.get_capacity();
+
+    if (!length || (length > b.get_capacity()) || (length + a_offset_min > capacity))
+        return std::make_pair(max_index, max_val);
+
+    // Offsets past the haystack get 0 and never make a maximum
+    a_offset_max = std::min<uint32_t>(a_offset_max, capacity - length + 1);
+    const int span = length + a_offset_max - 1;
+
+    std::vector<int64_t> energy_b;
+    std::vector<int64_t> energy_a;
+    prefix_energy(b, -(int)length, length, BOUND_SEGMENT_LEN, energy_b);
+    prefix_energy(a, -span, span, SUMMARY_BLOCK_LEN, energy_a);
+
+    // Energy of `a` region [start, end), rounded out to the prefix grid
+    auto region_energy = [&](int start, int end) {
+        const size_t from = (start + span) / SUMMARY_BLOCK_LEN;
+        const size_t to = std::min<size_t>((end + span + SUMMARY_BLOCK_LEN - 1) / SUMMARY_BLOCK_LEN,
+                                           energy_a.size() - 1);
+        return energy_a[to] - energy_a[from];
+    };
+
+    // Offsets are visited alternating around the hint, large values found
+    // early let the bound drop other offsets sooner
+    if ((hint < (int32_t)a_offset_min) || (hint >= (int32_t)a_offset_max))
+        hint = a_offset_min;
+    int32_t up{hint};
+    int32_t down{hint - 1};
+    bool take_up{true};
+
+    for (uint32_t n = a_offset_min; n < a_offset_max; n++) {
+        int32_t offset;
+        if ((up < (int32_t)a_offset_max) && (take_up || (down < (int32_t)a_offset_min)))
+            offset = up++;
+        else
+            offset = down--;
+        take_up = !take_up;
+
+        int64_t sum{0};
+        bool dropped{false};
+        for (size_t seg = 0, pos = 0; pos < length; seg++, pos += BOUND_SEGMENT_LEN) {
+            const int start_b = -(int)length + pos;
+            if (below_bound(sum, max_val, region_energy(start_b - offset, -offset),
+                            energy_b.back() - energy_b[seg])) {
+                dropped = true;
+                break;
+            }
+            sum += correlate_window(a, b, start_b, offset,
+                                    std::min<size_t>(BOUND_SEGMENT_LEN, length - pos));
+        }
+        if (dropped)
+            continue;
+
+        // Same result as correlate_max(): smallest offset of the positive maximum
+        if ((sum > max_val) || ((sum == max_val) && (max_val > 0) && (offset < max_index))) {
+            max_val = sum;
+            max_index = offset;
+        }
+    }
 
     return std::make_pair(max_index, max_val);
 }
+
+EXECUTE_FROM_RAM("cor")
+void correlator::correlate_fused_binned_into(const CircularBuffer &a,
+                        const CircularBuffer &b,
+                        uint32_t a_offset_min, 
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        uint32_t bin_step,
+                        int64_t *out_aa,
+                        int64_t *out_ab,
+                        int64_t *out_bb) {
+    for (uint32_t offset = a_offset_min; offset < a_offset_max; offset += bin_step) {
+        const uint32_t n_offsets = std::min(bin_step, a_offset_max - offset);
+        // Needles of `a` and `b` share the moving sum of `a`
+        if (!correlate_bin<true>(a, a, &b, offset, length, n_offsets, *out_aa, *out_ab)) {
+            *out_aa = bin_sum(a, a, offset, length, n_offsets);
+            *out_ab = bin_sum(a, b, offset, length, n_offsets);
+        }
+        out_aa++;
+        out_ab++;
+        // Not in the shared pass, haystack is `b`
+        if (out_bb)
+            *out_bb++ = bin_sum(b, b, offset, length, n_offsets);
+    }
+}
+
+CorrelationJob::CorrelationJob(const CircularBuffer &a,
+                               const CircularBuffer &b,
+                               uint32_t bin_step) :
+    m_a{a}, m_b{b}, m_bin_step{bin_step} {
+}
+
+void CorrelationJob::start(uint32_t a_offset_min,
+                           uint32_t a_offset_max,
+                           uint32_t length,
+                           const CircularBuffer *b2,
+                           uint32_t b2_offset_min) {
+    m_offset_min = a_offset_min;
+    m_offset_max = std::max(a_offset_min, a_offset_max);
+    m_length = length;
+    m_b2 = b2;
+    m_delay = 0;
+    m_cursor = 0;
+    m_active = true;
+    m_bins_b2_lead = (b2 && (b2_offset_min < a_offset_min)) ? (a_offset_min - b2_offset_min) / m_bin_step : 0;
+    // Storage is kept between jobs
+    const size_t n_bins = (m_offset_max - m_offset_min + m_bin_step - 1) / m_bin_step;
+    m_bins.assign(n_bins, 0);
+    m_bins_b2.assign(b2 ? m_bins_b2_lead + n_bins : 0, 0);
+}
+
+void CorrelationJob::advance(size_t n) {
+    if (!m_active || is_complete())
+        return;
+    m_delay += n;
+
+    // Needle and haystack of the remaining bins must still be in the buffers
+    if ((m_length + m_offset_max + m_delay > m_a.get_capacity()) ||
+        (m_length + m_delay > m_b.get_capacity()) ||
+        (m_b2 && (m_length + m_delay > m_b2->get_capacity()))) {
+        m_delay = 0;
+        m_cursor = 0;
+        m_restarts++;
+    }
+}
+
+bool CorrelationJob::step(size_t max_bins) {
+    if (!m_active)
+        return false;
+
+    const size_t last = std::min(m_cursor + max_bins, m_bins_b2_lead + m_bins.size());
+    for (; m_cursor < last; m_cursor++) {
+        if (m_cursor < m_bins_b2_lead) {
+            // Bins of b2 below the range of b
+            const uint32_t offset = get_b2_offset_min() + m_cursor * m_bin_step;
+            m_bins_b2[m_cursor] = bin_sum(m_a, *m_b2, offset, m_length, m_bin_step, m_delay);
+            continue;
+        }
+        const size_t bin = m_cursor - m_bins_b2_lead;
+        const uint32_t offset = m_offset_min + bin * m_bin_step;
+        const uint32_t n_offsets = std::min(m_bin_step, m_offset_max - offset);
+        int64_t &sum = m_bins[bin];
+
+        if (!m_b2) {
+            sum = bin_sum(m_a, m_b, offset, m_length, n_offsets, m_delay);
+            continue;
+        }
+        int64_t &sum2 = m_bins_b2[m_cursor];
+        if (!correlate_bin<true>(m_a, m_b, m_b2, offset, m_length, n_offsets, sum, sum2, m_delay)) {
+            sum = bin_sum(m_a, m_b, offset, m_length, n_offsets, m_delay);
+            sum2 = bin_sum(m_a, *m_b2, offset, m_length, n_offsets, m_delay);
+        }
+    }
+    return is_complete();
+}
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <vector>
 #include <utility>
+#include <algorithm>
 #include <functional>
 
 namespace correlator {
@@ -17,33 +18,89 @@ typedef struct {
     processing_unit_t b;
 } processing_pair_t;
 
+// Buffer keeps max sample magnitude per block of this many samples
+constexpr size_t SUMMARY_BLOCK_LEN{16};
+
+/*
+ * Circular buffer of samples.
+ * Mirrored buffer stores each sample twice, at i and i + capacity, so that any
+ * region is contiguous and is returned as a single chunk. It takes twice
+ * the memory and write time.
+ */
 class CircularBuffer final {
 public:
-    CircularBuffer(size_t size) : m_capacity{size} {
+    CircularBuffer(size_t size, bool mirrored = false) : m_capacity{size}, m_mirrored{mirrored} {
         // TODO throw something if it fails
-        m_data = new int16_t[size];
+        m_data = new int16_t[mirrored ? 2 * size : size]{};
+        m_block_max = new uint16_t[(size + SUMMARY_BLOCK_LEN - 1) / SUMMARY_BLOCK_LEN]{};
     }
 
     ~CircularBuffer() {
         delete[] m_data;
+        delete[] m_block_max;
     }
 
-    const int16_t *get_data() { return m_data; }
+    const int16_t *get_data() const { return m_data; }
     size_t get_data_ptr() const { return m_data_ptr; }
     size_t get_capacity() const { return m_capacity; }
+    bool is_mirrored() const { return m_mirrored; }
+    // Mirrored buffers only: samples from `start` (-capacity <= start < 0)
+    // up to the latest one are contiguous at the returned pointer
+    const int16_t *get_window(int start) const {
+        return m_data + m_data_ptr + start + ((-start > (int)m_data_ptr) ? m_capacity : 0);
+    }
 
     void write(const int16_t *buf, size_t length);
 
-    // Returns 1 or 2 chunks for the contiguous region
+    // Returns upper bound of sample magnitudes in region of `length` 
+    // starting at start (start < 0), with SUMMARY_BLOCK_LEN granularity
+    uint16_t get_max(int start, int length) const;
+
+    // Returns 1 or 2 (1 if mirrored) chunks for the contiguous region
     // of length <= m_capacity and starting at start (start < 0) 
     std::vector<processing_unit_t> get_data_chunks(int start, int length) const;
     // Same, but fills out and returns number of filled chunks
     size_t get_data_chunks_c(int start, int length, processing_unit_t out[2]) const;
 
 private:
-    int16_t *m_data;
-    size_t   m_data_ptr{0};
-    size_t   m_capacity;
+    int16_t  *m_data;
+    size_t    m_data_ptr{0};
+    size_t    m_capacity;
+    bool      m_mirrored;
+    uint16_t *m_block_max;
+
+    // Returns space for up to `length` samples at the write position, up to
+    // the buffer end
+    processing_unit_t claim(size_t length);
+    // Adds `length` samples filled in the claimed space to the buffer
+    void commit(size_t length);
+    void update_summary(size_t from, size_t to);
+};
+
+
+/*
+ * Read-only view of `length` samples of a buffer starting at `start` (start < 0),
+ * relative to the latest sample when the view is made. Later writes do not
+ * move the view, they overwrite its samples once the buffer wraps over them.
+ * View is empty if the buffer does not hold the region.
+ */
+class CircularBufferView final {
+public:
+    CircularBufferView(const CircularBuffer &buf, int start, int length);
+
+    size_t size() const { return m_length; }
+    // Region as 1 or 2 contiguous chunks
+    size_t get_n_chunks() const { return m_n_chunks; }
+    const processing_unit_t &get_chunk(size_t n) const { return m_chunks[n]; }
+
+    int16_t operator[](size_t n) const {
+        return (n < m_chunks[0].length) ? m_chunks[0].start[n] : m_chunks[1].start[n - m_chunks[0].length];
+    }
+
+private:
+    processing_unit_t m_chunks[2]{};
+    size_t m_n_chunks;
+    size_t m_length;
 };
 
 
@@ -66,22 +123,322 @@ size_t break_chunks(const CircularBuffer &a, const CircularBuffer &b,
 
 typedef std::function<void(int32_t, int64_t)> correlate_callback_t;
 
+/*
+ * Correlation engines. Correlation functions default to CORRELATE_DIRECT;
+ * the approximate FFT engine is opt-in, through CORRELATE_FFT or CORRELATE_AUTO.
+ */
+typedef enum {
+    // Picks the cheapest engine for the lag range and window length
+    CORRELATE_AUTO   = 0,
+    // Time-domain MAC over every lag, exact
+    CORRELATE_DIRECT = 1,
+    // Overlap-save FFT with block floating point, approximate
+    CORRELATE_FFT    = 2
+} correlate_engine_t;
+
+/*
+ * Returns the engine CORRELATE_AUTO would use for `n_offsets` lags
+ * over a window of `length` samples
+ */
+correlate_engine_t correlate_select_engine(uint32_t n_offsets, uint32_t length);
+
 /*
  * Performs correlation of buffers `a` and `b`, where `b` is treated as a needle,
  * and `a` as a haystack. Last `length` samples of `b` are correlated to `a`,
  * with offset range in a from `a_offset_min` to `a_offset_max` in the past, 
  * compared to `a`. Callback function is called with offset and correlation value
- * for each offset.
+ * for each offset, in ascending offset order.
+ * Callback is called through std::function for every offset; a lambda
+ * is inlined by the template overload below.
+ */
+void correlate(const CircularBuffer &a,
+                const CircularBuffer &b,
+                uint32_t a_offset_min, 
+                uint32_t a_offset_max,
+                uint32_t length,
+                correlate_callback_t &callback,
+                correlate_engine_t engine = CORRELATE_DIRECT);
+
+/*
+ * Same as correlate(), computed in frequency domain.
+ * Needle is split into segments which are correlated against the haystack
+ * with a fixed-point FFT (overlap-save); segment spectra are accumulated and
+ * transformed back once. Results are accurate to about 2^-10 of the largest
+ * correlation value. Returns false (and does not call `callback`)
+ * if the lag range does not fit the largest supported FFT.
  */
+bool correlate_fft(const CircularBuffer &a,
+                const CircularBuffer &b,
+                uint32_t a_offset_min, 
+                uint32_t a_offset_max,
+                uint32_t length,
+                correlate_callback_t &callback);
+
+/*
+ * Performs correlation as in correlate(), storing the value for
+ * offset n into out[n - a_offset_min]
+ */
+void correlate_into(const CircularBuffer &a,
+                const CircularBuffer &b,
+                uint32_t a_offset_min, 
+                uint32_t a_offset_max,
+                uint32_t length,
+                int64_t *out,
+                correlate_engine_t engine = CORRELATE_DIRECT);
+
+// Offsets correlated at once by the template correlate()
+constexpr size_t CORRELATE_OUT_BLOCK{64};
+
+/*
+ * Same as correlate(), with `callback` being any callable which the compiler
+ * may inline. Values are computed into a block on stack and passed to
+ * `callback` after each block, in ascending offset order.
+ */
+template <typename F>
 void correlate(const CircularBuffer &a,
                 const CircularBuffer &b,
                 uint32_t a_offset_min, 
                 uint32_t a_offset_max,
                 uint32_t length,
+                F &&callback,
+                correlate_engine_t engine = CORRELATE_DIRECT) {
+    // Engine is chosen for the whole range, not for a block
+    if (engine == CORRELATE_AUTO)
+        engine = correlate_select_engine(a_offset_max - a_offset_min, length);
+    if (engine == CORRELATE_FFT) {
+        correlate_callback_t f(std::ref(callback));
+        if (correlate_fft(a, b, a_offset_min, a_offset_max, length, f))
+            return;
+    }
+
+    int64_t out[CORRELATE_OUT_BLOCK];
+    for (uint32_t offset = a_offset_min; offset < a_offset_max; offset += CORRELATE_OUT_BLOCK) {
+        const uint32_t n = std::min<uint32_t>(CORRELATE_OUT_BLOCK, a_offset_max - offset);
+        correlate_into(a, b, offset, offset + n, length, out, CORRELATE_DIRECT);
+        for (uint32_t k = 0; k < n; k++)
+            callback(offset + k, out[k]);
+    }
+}
+
+/*
+ * Performs correlation as in correlate(), but returns sums of `bin_step`
+ * consecutive offsets. Callback is called for each bin with its first offset
+ * and the sum; last bin holds fewer offsets if the offset range is not a
+ * multiple of `bin_step`.
+ * Sum of correlations over a bin equals one correlation of the needle against
+ * a `bin_step` moving sum of the haystack, so each bin costs one pass over
+ * `length` samples. Bin sums are exact; samples are expected to fit into 13 bits
+ * and `bin_step` shall not exceed 64.
+ */
+void correlate_binned(const CircularBuffer &a,
+                const CircularBuffer &b,
+                uint32_t a_offset_min, 
+                uint32_t a_offset_max,
+                uint32_t length,
+                uint32_t bin_step,
                 correlate_callback_t &callback);
 
 /*
- * Performs correlation as in correlate(), but returns peak value offset and value
+ * Same as correlate_binned(), storing the sum of bin n (its first offset
+ * being a_offset_min + n * bin_step) into out[n]
+ */
+void correlate_binned_into(const CircularBuffer &a,
+                const CircularBuffer &b,
+                uint32_t a_offset_min, 
+                uint32_t a_offset_max,
+                uint32_t length,
+                uint32_t bin_step,
+                int64_t *out);
+
+/*
+ * Performs correlations of `a` to itself, of `b` (needle) to `a`, and, if
+ * `out_bb` is not null, of `b` to itself in one pass, as correlate_into() does
+ * for each of them. Haystack and needle samples are loaded once for all sums.
+ * Buffers shall be written in lockstep (same capacity and write position),
+ * otherwise the correlations are made one by one.
+ */
+void correlate_fused_into(const CircularBuffer &a,
+                const CircularBuffer &b,
+                uint32_t a_offset_min, 
+                uint32_t a_offset_max,
+                uint32_t length,
+                int64_t *out_aa,
+                int64_t *out_ab,
+                int64_t *out_bb = nullptr);
+
+/*
+ * Same as correlate_fused_into(), returning bin sums as correlate_binned_into().
+ * Both needles are correlated against one moving sum of `a`. B x B needs a
+ * moving sum of `b`, so `out_bb` bins are computed separately, bin by bin.
+ */
+void correlate_fused_binned_into(const CircularBuffer &a,
+                const CircularBuffer &b,
+                uint32_t a_offset_min, 
+                uint32_t a_offset_max,
+                uint32_t length,
+                uint32_t bin_step,
+                int64_t *out_aa,
+                int64_t *out_ab,
+                int64_t *out_bb = nullptr);
+
+/*
+ * Performs correlation as in correlate(), skipping products of silent regions.
+ * Needle is split into SUMMARY_BLOCK_LEN blocks; blocks with all magnitudes
+ * below `threshold` are skipped for all offsets, and active needle spans are
+ * skipped for an offset when the matching haystack span is below `threshold`.
+ * Run time depends on the share of active needle blocks, not on `length`.
+ * Returns upper bound of the absolute error of any value passed to `callback`.
+ */
+int64_t correlate_sparse(const CircularBuffer &a,
+                const CircularBuffer &b,
+                uint32_t a_offset_min, 
+                uint32_t a_offset_max,
+                uint32_t length,
+                uint16_t threshold,
+                correlate_callback_t &callback);
+
+/*
+ * Returns length of the latest window of `buf` holding `target_blocks` blocks
+ * of SUMMARY_BLOCK_LEN samples with magnitudes reaching `threshold`, rounded up
+ * to whole blocks and limited to [min_length, max_length] and the capacity.
+ * Dense signal gives a short window, sparse one extends up to `max_length`.
+ */
+uint32_t active_window_length(const CircularBuffer &buf,
+                uint32_t min_length,
+                uint32_t max_length,
+                uint16_t threshold,
+                uint32_t target_blocks);
+
+typedef struct {
+    // Offset of the largest correlation value
+    int32_t offset;
+    // Offset of the peak interpolated between samples
+    float   delay;
+    // Largest correlation value
+    int64_t peak;
+} correlate_peak_t;
+
+/*
+ * Finds correlation peak as correlate_max() does, correlating most offsets
+ * at a lower rate. Buffers are averaged over `decimation` samples and correlated
+ * over the whole offset range, which costs 1/decimation^2 of full rate.
+ * `n_candidates` largest coarse values are then correlated at full rate over
+ * +-(decimation - 1) offsets, up to the neighbouring coarse offsets, and the
+ * peak is interpolated with a parabola through its neighbours. Peaks narrower than `decimation` samples may be missed.
+ */
+correlate_peak_t correlate_coarse_fine(const CircularBuffer &a,
+                const CircularBuffer &b,
+                uint32_t a_offset_min, 
+                uint32_t a_offset_max,
+                uint32_t length,
+                uint32_t decimation = 4,
+                uint32_t n_candidates = 3);
+
+/*
+ * Keeps correlation sums of the last `length` samples of `b` against `a`,
+ * same as correlate() returns, and updates them as new samples arrive:
+ * products of the new samples are added and products leaving the window are
+ * subtracted, so an update of n samples costs 2 * n MACs per offset instead
+ * of `length`. Sums are exact, there is no drift.
+ * Both buffers must be written in lockstep, and must keep
+ * `length + a_offset_max + n` samples for an update of n samples, otherwise
+ * the sums are recalculated from scratch.
+ */
+class SlidingCorrelator final {
+public:
+    SlidingCorrelator(const CircularBuffer &a,
+                      const CircularBuffer &b,
+                      uint32_t a_offset_min,
+                      uint32_t a_offset_max,
+                      uint32_t length);
+    ~SlidingCorrelator() = default;
+
+    // Accounts for `n` samples just written to both buffers
+    void update(size_t n);
+    // Recalculates all sums from buffer contents
+    void reset();
+
+    // True when the window was filled with written samples
+    bool is_full() const { return m_written >= m_length; }
+    int64_t get(uint32_t offset) const { return m_sums[offset - m_offset_min]; }
+    const int64_t *get_sums() const { return m_sums.data(); }
+    // Calls callback for each offset, same as correlate() does
+    void get_all(correlate_callback_t &callback) const;
+
+private:
+    const CircularBuffer &m_a;
+    const CircularBuffer &m_b;
+    uint32_t m_offset_min;
+    uint32_t m_offset_max;
+    uint32_t m_length;
+    size_t   m_written{0};
+    std::vector<int64_t> m_sums;
+};
+
+/*
+ * Binned correlation of the last `length` samples of `b` against `a`, same as
+ * correlate_binned_into() returns, computed in slices of bins by step().
+ * If `b2` is given to start(), its needle is correlated to the same bins of `a`
+ * as in correlate_fused_binned_into(). Bins of `b2` may extend below
+ * `a_offset_min`, those are computed for `b2` only.
+ * Buffers may be written between slices; advance() keeps the job on the needle
+ * it was started with. When the buffers no longer hold it, the job restarts
+ * over the latest samples.
+ */
+class CorrelationJob final {
+public:
+    CorrelationJob(const CircularBuffer &a,
+                   const CircularBuffer &b,
+                   uint32_t bin_step);
+    ~CorrelationJob() = default;
+
+    // Starts the job over offsets [a_offset_min, a_offset_max), dropping previous bins.
+    // Bins of `b2` start at the lowest offset a_offset_min - n * bin_step
+    // which is not below `b2_offset_min`, by default at a_offset_min
+    void start(uint32_t a_offset_min,
+               uint32_t a_offset_max,
+               uint32_t length,
+               const CircularBuffer *b2 = nullptr,
+               uint32_t b2_offset_min = UINT32_MAX);
+    // Accounts for `n` samples written to the buffers since the last call
+    void advance(size_t n);
+    // Computes up to `max_bins` bins, returns true when all bins are done
+    bool step(size_t max_bins);
+
+    bool is_active() const { return m_active; }
+    bool is_complete() const { return m_active && (m_cursor == m_bins_b2_lead + m_bins.size()); }
+    // Makes the job inactive, bins stay available
+    void finish() { m_active = false; }
+
+    uint32_t get_offset_min() const { return m_offset_min; }
+    size_t get_n_bins() const { return m_bins.size(); }
+    const int64_t *get_bins() const { return m_bins.data(); }
+    uint32_t get_b2_offset_min() const { return m_offset_min - m_bins_b2_lead * m_bin_step; }
+    size_t get_n_bins_b2() const { return m_bins_b2.size(); }
+    const int64_t *get_bins_b2() const { return m_bins_b2.data(); }
+    // Number of restarts since construction
+    uint32_t get_restarts() const { return m_restarts; }
+
+private:
+    const CircularBuffer &m_a;
+    const CircularBuffer &m_b;
+    const CircularBuffer *m_b2{nullptr};
+    uint32_t m_bin_step;
+    uint32_t m_offset_min{0};
+    uint32_t m_offset_max{0};
+    uint32_t m_length{0};
+    uint32_t m_delay{0};   // samples written after the needle
+    size_t   m_cursor{0};  // next bin to compute, counting `b2` only bins first
+    size_t   m_bins_b2_lead{0}; // `b2` bins below m_offset_min
+    bool     m_active{false};
+    uint32_t m_restarts{0};
+    std::vector<int64_t> m_bins;
+    std::vector<int64_t> m_bins_b2;
+};
+
+/*
+ * Performs correlation as in correlate(), but returns peak value offset and value.
+ * Always uses the exact CORRELATE_DIRECT engine
  */
 std::pair<int32_t, int64_t> correlate_max(const CircularBuffer &a,
                                        const CircularBuffer &b,
@@ -89,5 +446,19 @@ std::pair<int32_t, int64_t> correlate_max(const CircularBuffer &a,
                                        uint32_t a_offset_max,
                                        uint32_t length);
 
+/*
+ * Same as correlate_max(), with the same result, but offsets which cannot
+ * beat the maximum found so far are dropped early. Prefix energies of both
+ * buffers bound the rest of an offset's sum by Cauchy-Schwarz, which is checked
+ * every 128 needle samples. Offsets are visited starting from
+ * `hint`, usually the previous peak; a hint out of range starts from `a_offset_min`.
+ */
+std::pair<int32_t, int64_t> correlate_max_bounded(const CircularBuffer &a,
+                                       const CircularBuffer &b,
+                                       uint32_t a_offset_min, 
+                                       uint32_t a_offset_max,
+                                       uint32_t length,
+                                       int32_t hint);
+
 
 };
@@ -0,0 +1,183 @@
+#include <string.h>
+#include "correlator.h"
+#include "fft.h"
+
+using namespace correlator;
+using correlator::fft::complex_t;
+
+
+#define likely(x)       __builtin_expect((x),1)
+#define unlikely(x)     __builtin_expect((x),0)
+
+#ifndef PLATFORM_NATIVE
+#define EXECUTE_FROM_RAM(subsection) __attribute__ ((long_call, section (".time_critical." subsection)))
+#else
+#define EXECUTE_FROM_RAM(subsection)
+#endif
+
+// Relative costs of FFT operations, in units of a single time-domain MAC
+constexpr uint32_t COST_BUTTERFLY{8};
+constexpr uint32_t COST_SPECTRUM_BIN{12};
+// Spectrum is normalised to this many bits before products are taken,
+// so that a product of two (sum/difference) values fits into int32
+constexpr uint8_t PRODUCT_BITS{13};
+// Spectrum accumulator drops that many low bits of each product
+constexpr int ACC_DROP_BITS{8};
+
+typedef struct {
+    int64_t re;
+    int64_t im;
+} acc_complex_t;
+
+typedef struct {
+    uint8_t  log2_size;
+    uint32_t segment_len;
+    uint32_t n_segments;
+    uint64_t cost;
+} fft_plan_t;
+
+/*
+ * Chooses FFT size for correlating `length` samples at `n_offsets` lags.
+ * Each FFT block holds `segment_len` needle samples and
+ * `segment_len + n_offsets - 1` haystack samples.
+ */
+static bool fft_plan(uint32_t n_offsets, uint32_t length, fft_plan_t &plan) {
+    bool found{false};
+
+    for (uint8_t log2_size = 2; log2_size <= fft::FFT_MAX_LOG2_SIZE; log2_size++) {
+        const uint32_t size = 1UL << log2_size;
+        if (size < n_offsets)
+            continue;
+        const uint32_t segment_len = size - n_offsets + 1;
+        const uint32_t n_segments = (length + segment_len - 1) / segment_len;
+        // n_segments forward transforms and one inverse
+        const uint64_t cost = (uint64_t)(n_segments + 1) * (size / 2) * log2_size * COST_BUTTERFLY +
+                              (uint64_t)n_segments * (size / 2) * COST_SPECTRUM_BIN;
+        if (!found || (cost < plan.cost)) {
+            plan = {log2_size, segment_len, n_segments, cost};
+            found = true;
+        }
+    }
+    return found;
+}
+
+correlate_engine_t correlator::correlate_select_engine(uint32_t n_offsets, uint32_t length) {
+    fft_plan_t plan;
+
+    if (!n_offsets || !length)
+        return CORRELATE_DIRECT;
+    if (!fft_plan(n_offsets, length, plan))
+        return CORRELATE_DIRECT;
+    if (plan.cost < (uint64_t)n_offsets * length)
+        return CORRELATE_FFT;
+    return CORRELATE_DIRECT;
+}
+
+// Copies samples [start, start+length) of `buf` into `field` of `out`
+static void load_samples(const CircularBuffer &buf, int start, int length,
+                         complex_t *out, int32_t complex_t::*field) {
+    processing_unit_t chunks[2];
+    size_t n_chunks = buf.get_data_chunks_c(start, length, chunks);
+
+    for (size_t n = 0; n < n_chunks; n++) {
+        const int16_t *p = chunks[n].start;
+        for (size_t m = 0; m < chunks[n].length; m++)
+            (out++)->*field = *p++;
+    }
+}
+
+static inline int64_t scale(int64_t val, int shift) {
+    if (shift >= 0)
+        return val << shift;
+    return (val + (1LL << (-shift - 1))) >> -shift;
+}
+
+EXECUTE_FROM_RAM("cor")
+static void accumulate_spectrum(const complex_t *buf, size_t size, int shift,
+                                acc_complex_t *acc) {
+    // buf holds X = FFT(h + j*b), h and b being real. For each bin
+    //   2H = X[k] + conj(X[N-k]), 2jB = X[k] - conj(X[N-k])
+    // and 4*H*conj(B) = j * 2H * conj(2jB)
+    const size_t mask = size - 1;
+    for (size_t k = 0; k <= size / 2; k++) {
+        const complex_t x = buf[k];
+        const complex_t y = buf[(size - k) & mask];
+        const int32_t ur = x.re + y.re;
+        const int32_t ui = x.im - y.im;
+        const int32_t vr = x.re - y.re;
+        const int32_t vi = -(x.im + y.im);
+        const int32_t pr = ur * vr - ui * vi;
+        const int32_t pi = ur * vi + ui * vr;
+        acc[k].re += scale(-pi, shift);
+        acc[k].im += scale(pr, shift);
+    }
+}
+
+EXECUTE_FROM_RAM("cor")
+bool correlator::correlate_fft(const CircularBuffer &a,
+                        const CircularBuffer &b,
+                        uint32_t a_offset_min,
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        correlator::correlate_callback_t &callback) {
+    if ((a_offset_max <= a_offset_min) || !length)
+        return true;
+
+    const uint32_t n_offsets = a_offset_max - a_offset_min;
+    fft_plan_t plan;
+    if (!fft_plan(n_offsets, length, plan))
+        return false;
+    // All lags must have data, as there is no per-lag fallback here
+    if ((length + a_offset_max - 1 > a.get_capacity()) || (length > b.get_capacity()))
+        return false;
+
+    const fft::BlockFFT fft(plan.log2_size);
+    const size_t size = fft.size();
+    std::vector<complex_t> buf(size);
+    // Product spectrum is Hermitian, only first half is stored
+    std::vector<acc_complex_t> acc(size / 2 + 1);
+
+    // Haystack sample h[i] is a[start_h + i], lag index k = a_offset_max - 1 - offset
+    const int start_h = -(int)length - (int)(a_offset_max - 1);
+    const int start_b = -(int)length;
+
+    for (uint32_t m0 = 0; m0 < length; m0 += plan.segment_len) {
+        const uint32_t len_b = std::min(plan.segment_len, length - m0);
+        const uint32_t len_h = len_b + n_offsets - 1;
+
+        memset(buf.data(), 0, size * sizeof(complex_t));
+        load_samples(a, start_h + m0, len_h, buf.data(), &complex_t::re);
+        load_samples(b, start_b + m0, len_b, buf.data(), &complex_t::im);
+
+        int exponent = fft.forward(buf.data());
+        exponent += fft::normalise(buf.data(), size, PRODUCT_BITS);
+        accumulate_spectrum(buf.data(), size, 2*exponent - ACC_DROP_BITS, acc.data());
+    }
+
+    // Convert accumulated spectrum back to int32 block and restore full spectrum
+    uint64_t mag{0};
+    for (const auto &v: acc)
+        mag |= (uint64_t)llabs(v.re) | (uint64_t)llabs(v.im);
+    int acc_shift{0};
+    while ((mag >> acc_shift) >= (1ULL << fft::FFT_HEADROOM_BITS))
+        acc_shift++;
+
+    for (size_t k = 0; k <= size / 2; k++) {
+        buf[k].re = scale(acc[k].re, -acc_shift);
+        buf[k].im = scale(acc[k].im, -acc_shift);
+        if (k && (k < size / 2)) {
+            buf[size - k].re = buf[k].re;
+            buf[size - k].im = -buf[k].im;
+        }
+    }
+
+    const int exponent = fft.inverse(buf.data());
+    // c[k] = IFFT(4*S)/4/N, accumulator was scaled down by ACC_DROP_BITS
+    const int out_shift = exponent + acc_shift + ACC_DROP_BITS - 2 - fft.log2_size();
+
+    for (uint32_t offset = a_offset_min; offset < a_offset_max; offset++) {
+        const size_t k = a_offset_max - 1 - offset;
+        callback(offset, scale(buf[k].re, out_shift));
+    }
+    return true;
+}
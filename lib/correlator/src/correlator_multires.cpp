@@ -0,0 +1,128 @@
+#include <algorithm>
+#include "correlator.h"
+
+using namespace correlator;
+
+
+#define likely(x)       __builtin_expect((x),1)
+#define unlikely(x)     __builtin_expect((x),0)
+
+#ifndef PLATFORM_NATIVE
+#define EXECUTE_FROM_RAM(subsection) __attribute__ ((long_call, section (".time_critical." subsection)))
+#else
+#define EXECUTE_FROM_RAM(subsection)
+#endif
+
+/*
+ * Writes `n_out` boxcar averages of `decimation` samples of `src` into `dst`.
+ * Averages are aligned to the latest sample, so that offset q in `dst`
+ * matches offset q * decimation in `src`.
+ */
+EXECUTE_FROM_RAM("cor")
+static void decimate(const CircularBuffer &src, size_t n_out, uint32_t decimation,
+                     CircularBuffer &dst) {
+    processing_unit_t chunks[2];
+    size_t n_chunks = src.get_data_chunks_c(-(int)(n_out * decimation), n_out * decimation, chunks);
+    int16_t out[16];
+    size_t n_buf{0};
+    int32_t sum{0};
+    uint32_t count{0};
+
+    for (size_t n = 0; n < n_chunks; n++) {
+        const int16_t *p = chunks[n].start;
+        for (size_t k = 0; k < chunks[n].length; k++) {
+            sum += p[k];
+            if (++count < decimation)
+                continue;
+            // Average keeps the sample range, correlate() relies on it
+            out[n_buf++] = sum / (int32_t)decimation;
+            sum = 0;
+            count = 0;
+            if (n_buf == sizeof(out)/sizeof(out[0])) {
+                dst.write(out, n_buf);
+                n_buf = 0;
+            }
+        }
+    }
+    dst.write(out, n_buf);
+}
+
+// Correlates a few offsets at full rate, returns the largest value and its offset
+static std::pair<int32_t, int64_t> refine(const CircularBuffer &a, const CircularBuffer &b,
+                                          uint32_t a_offset_min, uint32_t a_offset_max,
+                                          uint32_t length) {
+    int32_t max_index{0};
+    int64_t max_val{0};
+    correlate(a, b, a_offset_min, a_offset_max, length, [&](int32_t offset, int64_t sum) {
+        if (sum > max_val) {
+            max_val = sum;
+            max_index = offset;
+        }
+    }, CORRELATE_DIRECT);
+    return std::make_pair(max_index, max_val);
+}
+
+correlate_peak_t correlator::correlate_coarse_fine(const CircularBuffer &a,
+                        const CircularBuffer &b,
+                        uint32_t a_offset_min, 
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        uint32_t decimation,
+                        uint32_t n_candidates) {
+    correlate_peak_t ret{0, 0.0f, 0};
+    if ((a_offset_max <= a_offset_min) || !decimation)
+        return ret;
+
+    // Coarse pass: offset q stands for offsets around q * decimation
+    const uint32_t coarse_min = a_offset_min / decimation;
+    const uint32_t coarse_max = (a_offset_max - 1) / decimation + 1;
+    const uint32_t coarse_len = length / decimation;
+    const size_t span_a = std::min<size_t>(coarse_len + coarse_max, a.get_capacity() / decimation);
+    const size_t span_b = std::min<size_t>(coarse_len, b.get_capacity() / decimation);
+    CircularBuffer coarse_a(span_a);
+    CircularBuffer coarse_b(span_b);
+    decimate(a, span_a, decimation, coarse_a);
+    decimate(b, span_b, decimation, coarse_b);
+
+    std::vector<int64_t> coarse(coarse_max - coarse_min);
+    // Exact, as refine() is: candidate ranking must not depend on FFT rounding
+    correlate_into(coarse_a, coarse_b, coarse_min, coarse_max, coarse_len, coarse.data(),
+                   CORRELATE_DIRECT);
+
+    // Best candidates are refined at full rate, each covering
+    // the offsets up to its neighbours
+    for (uint32_t k = 0; k < n_candidates; k++) {
+        auto it = std::max_element(coarse.begin(), coarse.end());
+        if ((it == coarse.end()) || (*it <= 0))
+            break;
+        const int32_t q = coarse_min + (it - coarse.begin());
+        // Neighbours belong to the same peak
+        *it = 0;
+        if (it != coarse.begin())
+            *(it - 1) = 0;
+        if (it + 1 != coarse.end())
+            *(it + 1) = 0;
+
+        const uint32_t min = std::max<int32_t>(a_offset_min, (q - 1) * (int32_t)decimation + 1);
+        const uint32_t max = std::min<uint32_t>(a_offset_max, (q + 1) * decimation);
+        auto peak = refine(a, b, min, max, length);
+        if ((peak.second > ret.peak) || 
+            ((peak.second == ret.peak) && (peak.second > 0) && (peak.first < ret.offset))) {
+            ret.offset = peak.first;
+            ret.peak = peak.second;
+        }
+    }
+    ret.delay = ret.offset;
+    if (ret.peak <= 0)
+        return ret;
+
+    // Parabola through the peak and its neighbours
+    if ((ret.offset > (int32_t)a_offset_min) && (ret.offset + 1 < (int32_t)a_offset_max)) {
+        int64_t y[3];
+        correlate_into(a, b, ret.offset - 1, ret.offset + 2, length, y, CORRELATE_DIRECT);
+        const int64_t curvature = y[0] - 2 * y[1] + y[2];
+        if (curvature < 0)
+            ret.delay += 0.5f * (float)(y[0] - y[2]) / (float)curvature;
+    }
+    return ret;
+}
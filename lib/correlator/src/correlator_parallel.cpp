@@ -0,0 +1,95 @@
+#include <algorithm>
+#include "executor.h"
+
+using namespace correlator;
+
+
+// Shards of direct correlation start on whole lag blocks of its kernel
+constexpr uint32_t SHARD_ALIGN{4};
+
+/*
+ * Splits offsets [a_offset_min, a_offset_max) into one contiguous shard per
+ * executor thread, with shard bounds at multiples of `align` from a_offset_min,
+ * and runs shard(first, last) for each of them.
+ */
+static void run_shards(Executor &executor, uint32_t a_offset_min, uint32_t a_offset_max,
+                       uint32_t align, const std::function<void(uint32_t, uint32_t)> &shard) {
+    if (a_offset_max <= a_offset_min || !align)
+        return;
+    const size_t n_units = (a_offset_max - a_offset_min + align - 1) / align;
+    const size_t n_shards = std::min(executor.get_concurrency(), n_units);
+
+    executor.run(n_shards, [&](size_t n) {
+        const uint32_t first = a_offset_min + (n_units * n / n_shards) * align;
+        const uint32_t last = std::min<uint32_t>(a_offset_min + (n_units * (n + 1) / n_shards) * align,
+                                                 a_offset_max);
+        shard(first, last);
+    });
+}
+
+void correlator::correlate_into(const CircularBuffer &a,
+                        const CircularBuffer &b,
+                        uint32_t a_offset_min,
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        int64_t *out,
+                        Executor &executor,
+                        correlate_engine_t engine) {
+    if (engine == CORRELATE_AUTO)
+        engine = correlate_select_engine(a_offset_max - a_offset_min, length);
+    if (engine == CORRELATE_FFT) {
+        correlate_into(a, b, a_offset_min, a_offset_max, length, out, CORRELATE_FFT);
+        return;
+    }
+
+    run_shards(executor, a_offset_min, a_offset_max, SHARD_ALIGN, [&](uint32_t first, uint32_t last) {
+        correlate_into(a, b, first, last, length, out + (first - a_offset_min), CORRELATE_DIRECT);
+    });
+}
+
+void correlator::correlate(const CircularBuffer &a,
+                        const CircularBuffer &b,
+                        uint32_t a_offset_min,
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        correlate_callback_t &callback,
+                        Executor &executor,
+                        correlate_engine_t engine) {
+    if (a_offset_max <= a_offset_min)
+        return;
+    std::vector<int64_t> out(a_offset_max - a_offset_min);
+    correlate_into(a, b, a_offset_min, a_offset_max, length, out.data(), executor, engine);
+    for (uint32_t offset = a_offset_min; offset < a_offset_max; offset++)
+        callback(offset, out[offset - a_offset_min]);
+}
+
+void correlator::correlate_binned_into(const CircularBuffer &a,
+                        const CircularBuffer &b,
+                        uint32_t a_offset_min,
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        uint32_t bin_step,
+                        int64_t *out,
+                        Executor &executor) {
+    run_shards(executor, a_offset_min, a_offset_max, bin_step, [&](uint32_t first, uint32_t last) {
+        correlate_binned_into(a, b, first, last, length, bin_step,
+                              out + (first - a_offset_min) / bin_step);
+    });
+}
+
+void correlator::correlate_fused_binned_into(const CircularBuffer &a,
+                        const CircularBuffer &b,
+                        uint32_t a_offset_min,
+                        uint32_t a_offset_max,
+                        uint32_t length,
+                        uint32_t bin_step,
+                        int64_t *out_aa,
+                        int64_t *out_ab,
+                        int64_t *out_bb,
+                        Executor &executor) {
+    run_shards(executor, a_offset_min, a_offset_max, bin_step, [&](uint32_t first, uint32_t last) {
+        const size_t bin = (first - a_offset_min) / bin_step;
+        correlate_fused_binned_into(a, b, first, last, length, bin_step,
+                                    out_aa + bin, out_ab + bin, out_bb ? out_bb + bin : nullptr);
+    });
+}
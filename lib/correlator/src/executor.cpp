@@ -0,0 +1,133 @@
+#include <algorithm>
+#include "executor.h"
+
+using namespace correlator;
+
+
+void SerialExecutor::run(size_t n_jobs, const executor_job_t &job) {
+    for (size_t n = 0; n < n_jobs; n++)
+        job(n);
+}
+
+#ifdef PLATFORM_NATIVE
+
+ThreadExecutor::ThreadExecutor(size_t n_workers) :
+    m_concurrency{n_workers + 1} {
+    for (size_t n = 0; n < n_workers; n++)
+        m_workers.emplace_back(&ThreadExecutor::worker, this, n + 1);
+}
+
+ThreadExecutor::~ThreadExecutor() {
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_stop = true;
+    }
+    m_start.notify_all();
+    for (auto &w: m_workers)
+        w.join();
+}
+
+void ThreadExecutor::run(size_t n_jobs, const executor_job_t &job) {
+    const size_t concurrency = get_concurrency();
+    if (n_jobs <= 1 || concurrency == 1) {
+        for (size_t n = 0; n < n_jobs; n++)
+            job(n);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_job = &job;
+        m_n_jobs = n_jobs;
+        m_pending = m_workers.size();
+        m_batch++;
+    }
+    m_start.notify_all();
+
+    for (size_t n = 0; n < n_jobs; n += concurrency)
+        job(n);
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_done.wait(lock, [this] { return m_pending == 0; });
+    m_job = nullptr;
+}
+
+void ThreadExecutor::worker(size_t index) {
+    const size_t concurrency = get_concurrency();
+    uint32_t batch{0};
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    while (true) {
+        m_start.wait(lock, [&] { return m_stop || (m_batch != batch); });
+        if (m_stop)
+            return;
+        batch = m_batch;
+        const executor_job_t *job = m_job;
+        const size_t n_jobs = m_n_jobs;
+
+        lock.unlock();
+        for (size_t n = index; n < n_jobs; n += concurrency)
+            (*job)(n);
+        lock.lock();
+
+        if (--m_pending == 0)
+            m_done.notify_one();
+    }
+}
+
+#else
+
+TaskExecutor::TaskExecutor(size_t n_workers, UBaseType_t core_mask,
+                           configSTACK_DEPTH_TYPE stack_size) {
+    m_done = xSemaphoreCreateCounting(n_workers, 0);
+    const UBaseType_t priority = uxTaskPriorityGet(NULL);
+    m_workers.resize(n_workers);
+    for (size_t n = 0; n < n_workers; n++) {
+        auto &w = m_workers[n];
+        w.executor = this;
+        w.thread = n + 1;
+        // Affinity is set before the task may start running
+        xTaskCreateAffinitySet(worker_task, "cor_worker", stack_size, &w, priority, core_mask, &w.handle);
+    }
+}
+
+TaskExecutor::~TaskExecutor() {
+    // Workers are idle between batches
+    for (const auto &w: m_workers)
+        vTaskDelete(w.handle);
+    vSemaphoreDelete(m_done);
+}
+
+void TaskExecutor::run(size_t n_jobs, const executor_job_t &job) {
+    m_job = &job;
+    m_n_jobs = n_jobs;
+
+    // Workers without jobs in this batch are not woken up
+    const size_t n_woken = std::min(m_workers.size(), n_jobs ? n_jobs - 1 : 0);
+    for (size_t n = 0; n < n_woken; n++)
+        xTaskNotifyGive(m_workers[n].handle);
+
+    run_jobs(0);
+
+    for (size_t n = 0; n < n_woken; n++)
+        xSemaphoreTake(m_done, portMAX_DELAY);
+    m_job = nullptr;
+}
+
+void TaskExecutor::run_jobs(size_t thread) {
+    const size_t concurrency = get_concurrency();
+    for (size_t n = thread; n < m_n_jobs; n += concurrency)
+        (*m_job)(n);
+}
+
+void TaskExecutor::worker_task(void *pvParameters) {
+    const auto worker = static_cast<const worker_t *>(pvParameters);
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        worker->executor->run_jobs(worker->thread);
+        xSemaphoreGive(worker->executor->m_done);
+    }
+}
+
+#endif
@@ -0,0 +1,167 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <functional>
+#include "correlator.h"
+
+#ifdef PLATFORM_NATIVE
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#else
+#include <FreeRTOS.h>
+#include <task.h>
+#include <semphr.h>
+#endif
+
+namespace correlator {
+
+// Job of an executor batch, called with the job index
+typedef std::function<void(size_t)> executor_job_t;
+
+/*
+ * Runs batches of independent jobs. Job n of a batch is always run by
+ * thread n % get_concurrency(), thread 0 being the caller of run(),
+ * so that the split of work does not depend on scheduling.
+ */
+class Executor {
+public:
+    virtual ~Executor() {}
+
+    // Number of threads jobs are run on, including the caller
+    virtual size_t get_concurrency() const = 0;
+    // Runs jobs 0..n_jobs-1 and returns when all of them are complete
+    virtual void run(size_t n_jobs, const executor_job_t &job) = 0;
+};
+
+/*
+ * Runs all jobs in the calling thread
+ */
+class SerialExecutor final : public Executor {
+public:
+    size_t get_concurrency() const override { return 1; }
+    void run(size_t n_jobs, const executor_job_t &job) override;
+};
+
+#ifdef PLATFORM_NATIVE
+
+/*
+ * Runs jobs on the caller and `n_workers` std::thread workers,
+ * which are started once and wait for batches in between.
+ */
+class ThreadExecutor final : public Executor {
+public:
+    ThreadExecutor(size_t n_workers);
+    ~ThreadExecutor();
+
+    size_t get_concurrency() const override { return m_concurrency; }
+    void run(size_t n_jobs, const executor_job_t &job) override;
+
+private:
+    void worker(size_t index);
+
+    const size_t             m_concurrency;
+    std::vector<std::thread> m_workers;
+    std::mutex               m_lock;
+    std::condition_variable  m_start;
+    std::condition_variable  m_done;
+    const executor_job_t    *m_job{nullptr};
+    size_t                   m_n_jobs{0};
+    uint32_t                 m_batch{0};   // incremented for every batch
+    size_t                   m_pending{0}; // workers yet to complete the batch
+    bool                     m_stop{false};
+};
+
+#else
+
+/*
+ * Runs jobs on the caller and `n_workers` FreeRTOS tasks, pinned with
+ * `core_mask` (e.g. the core the caller is not running on).
+ * Worker tasks are created once with the priority of the constructing task.
+ */
+class TaskExecutor final : public Executor {
+public:
+    TaskExecutor(size_t n_workers, UBaseType_t core_mask,
+                 configSTACK_DEPTH_TYPE stack_size = 1024);
+    ~TaskExecutor();
+
+    size_t get_concurrency() const override { return m_workers.size() + 1; }
+    void run(size_t n_jobs, const executor_job_t &job) override;
+
+private:
+    // Parameter of a worker task
+    typedef struct {
+        TaskExecutor *executor;
+        size_t        thread;       // executor thread index, 1..n_workers
+        TaskHandle_t  handle;
+    } worker_t;
+
+    static void worker_task(void *pvParameters);
+    void run_jobs(size_t thread);
+
+    // Sized once in the constructor, tasks keep pointers to their entries
+    std::vector<worker_t>     m_workers;
+    SemaphoreHandle_t         m_done;
+    const executor_job_t     *m_job{nullptr};
+    size_t                    m_n_jobs{0};
+};
+
+#endif
+
+/*
+ * Same as correlate_into(), with the lag range split into contiguous shards
+ * run by `executor`. Every shard writes its own part of `out`, so results
+ * do not depend on the number of threads. FFT engine covers the whole range
+ * at once and runs in the calling thread.
+ */
+void correlate_into(const CircularBuffer &a,
+                const CircularBuffer &b,
+                uint32_t a_offset_min,
+                uint32_t a_offset_max,
+                uint32_t length,
+                int64_t *out,
+                Executor &executor,
+                correlate_engine_t engine = CORRELATE_DIRECT);
+
+/*
+ * Same as correlate(), computed with correlate_into() over `executor`.
+ * Callback is called from the calling thread after all shards are complete.
+ */
+void correlate(const CircularBuffer &a,
+                const CircularBuffer &b,
+                uint32_t a_offset_min,
+                uint32_t a_offset_max,
+                uint32_t length,
+                correlate_callback_t &callback,
+                Executor &executor,
+                correlate_engine_t engine = CORRELATE_DIRECT);
+
+/*
+ * Same as correlate_binned_into(), with whole bins split between threads
+ * of `executor`.
+ */
+void correlate_binned_into(const CircularBuffer &a,
+                const CircularBuffer &b,
+                uint32_t a_offset_min,
+                uint32_t a_offset_max,
+                uint32_t length,
+                uint32_t bin_step,
+                int64_t *out,
+                Executor &executor);
+
+/*
+ * Same as correlate_fused_binned_into(), with whole bins split between
+ * threads of `executor`.
+ */
+void correlate_fused_binned_into(const CircularBuffer &a,
+                const CircularBuffer &b,
+                uint32_t a_offset_min,
+                uint32_t a_offset_max,
+                uint32_t length,
+                uint32_t bin_step,
+                int64_t *out_aa,
+                int64_t *out_ab,
+                int64_t *out_bb,
+                Executor &executor);
+
+}
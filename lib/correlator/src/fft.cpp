@@ -0,0 +1,99 @@
+#include <math.h>
+#include "fft.h"
+
+using namespace correlator::fft;
+
+
+#define likely(x)       __builtin_expect((x),1)
+#define unlikely(x)     __builtin_expect((x),0)
+
+#ifndef PLATFORM_NATIVE
+#define EXECUTE_FROM_RAM(subsection) __attribute__ ((long_call, section (".time_critical." subsection)))
+#else
+#define EXECUTE_FROM_RAM(subsection)
+#endif
+
+
+constexpr int32_t Q15_ROUND{1 << 14};
+
+BlockFFT::BlockFFT(uint8_t log2_size) :
+    m_log2_size{log2_size}, m_size{1UL << log2_size} {
+    const size_t half = m_size / 2;
+
+    // Twiddles are calculated once, rounded to Q15
+    m_twiddle.resize(half * 2);
+    for (size_t k = 0; k < half; k++) {
+        const double phase = 2.0 * M_PI * k / m_size;
+        m_twiddle[2*k]     = lround(cos(phase) * INT16_MAX);
+        m_twiddle[2*k + 1] = lround(sin(phase) * INT16_MAX);
+    }
+}
+
+EXECUTE_FROM_RAM("fft")
+int correlator::fft::normalise(complex_t *buf, size_t length, uint8_t bits) {
+    // OR of magnitudes has the same highest bit as the maximum magnitude
+    uint32_t mag{0};
+    for (size_t n = 0; n < length; n++) {
+        mag |= abs(buf[n].re);
+        mag |= abs(buf[n].im);
+    }
+
+    int shift{0};
+    while ((mag >> shift) >= (1UL << bits))
+        shift++;
+    if (likely(!shift))
+        return 0;
+
+    const int32_t round = 1 << (shift - 1);
+    for (size_t n = 0; n < length; n++) {
+        buf[n].re = (buf[n].re + round) >> shift;
+        buf[n].im = (buf[n].im + round) >> shift;
+    }
+    return shift;
+}
+
+EXECUTE_FROM_RAM("fft")
+int BlockFFT::transform(complex_t *buf, bool inverse) const {
+    const size_t size = m_size;
+    const int16_t *twiddle = m_twiddle.data();
+    int exponent{0};
+
+    // Bit-reversed reordering
+    for (size_t i = 1, j = 0; i < size; i++) {
+        size_t bit = size >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            complex_t t = buf[i];
+            buf[i] = buf[j];
+            buf[j] = t;
+        }
+    }
+
+    for (size_t len = 2; len <= size; len <<= 1) {
+        // Block floating point: rescale only when the next stage could overflow
+        exponent += normalise(buf, size, FFT_HEADROOM_BITS);
+
+        const size_t half = len / 2;
+        const size_t step = size / len;
+        for (size_t k = 0; k < half; k++) {
+            // W = cos - j*sin for the forward transform, conjugate for inverse
+            const int32_t wr = twiddle[2*k*step];
+            const int32_t wi = inverse ? twiddle[2*k*step + 1] : -twiddle[2*k*step + 1];
+
+            for (size_t i = k; i < size; i += len) {
+                complex_t *pa = &buf[i];
+                complex_t *pb = &buf[i + half];
+                const int32_t tr = (pb->re * wr - pb->im * wi + Q15_ROUND) >> 15;
+                const int32_t ti = (pb->re * wi + pb->im * wr + Q15_ROUND) >> 15;
+                pb->re = pa->re - tr;
+                pb->im = pa->im - ti;
+                pa->re += tr;
+                pa->im += ti;
+            }
+        }
+    }
+
+    return exponent;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+
+namespace correlator {
+namespace fft {
+
+typedef struct {
+    int32_t re;
+    int32_t im;
+} complex_t;
+
+// Values are kept below 2^FFT_HEADROOM_BITS before each butterfly stage,
+// so that Q15 twiddle products and butterfly sums fit into int32
+constexpr uint8_t FFT_HEADROOM_BITS{14};
+constexpr uint8_t FFT_MAX_LOG2_SIZE{11};
+
+/*
+ * Shifts all values in `buf` right until every component is below
+ * 2^`bits` in magnitude. Returns the applied shift, so that
+ * true value = stored value * 2^shift.
+ */
+int normalise(complex_t *buf, size_t length, uint8_t bits);
+
+/*
+ * In-place radix-2 decimation-in-time FFT over int32 data with
+ * block floating point scaling and Q15 twiddle factors.
+ * Both transforms are unnormalised (no 1/N in the inverse) and return
+ * the block exponent of the result: true value = buf * 2^exponent.
+ */
+class BlockFFT final {
+public:
+    BlockFFT(uint8_t log2_size);
+    ~BlockFFT() = default;
+
+    size_t size() const { return m_size; }
+    uint8_t log2_size() const { return m_log2_size; }
+
+    int forward(complex_t *buf) const { return transform(buf, false); }
+    int inverse(complex_t *buf) const { return transform(buf, true); }
+
+private:
+    uint8_t m_log2_size;
+    size_t  m_size;
+    // cos/sin pairs for W_N^k, k < N/2, Q15
+    std::vector<int16_t> m_twiddle;
+
+    int transform(complex_t *buf, bool inverse) const;
+};
+
+}
+}
@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <vector>
 #include <deque>
+#include <algorithm>
 
 namespace detector {
 
@@ -23,10 +24,33 @@ public:
         m_threshold{threshold}, m_min_length{min_length} {}
 
     void write(const int16_t *data, size_t length);
+    // Processes one sample, for stages which produce samples one at a time
+    void write_one(int32_t sample) {
+        // object detector
+        bool v = sample > m_threshold;
+        if (v) {
+            if (!m_in_obj) {
+                m_in_obj = true;
+                m_obj_start = m_timestamp;
+                m_obj_ampl = sample;
+                m_obj_power = sample;
+            } else {
+                m_obj_ampl = std::max(m_obj_ampl, sample);
+                m_obj_power += sample;
+            }
+        } else {
+            if (__builtin_expect(m_in_obj, 0))
+                end_object();
+        }
+
+        m_timestamp++;
+    }
     uint64_t get_timestamp() { return m_timestamp; }
 
     std::deque<detected_object_t> results{};
 private:
+    void end_object();
+
     // m_timestamp increases with each sample, providing timestamp for detected objects
     uint64_t m_timestamp{0};
     // Threshold for object detection
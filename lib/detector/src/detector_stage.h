@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include "filter.h"
+#include "detector.h"
+
+namespace detector {
+
+/*
+ * Fused FIR -> DC block -> ObjectDetector stage: every FIR output goes
+ * through the DC block recurrence and the detector while it is still in
+ * registers, instead of being stored to and read back from two output
+ * queues. FIR and DC block outputs are queued only while their taps are
+ * active, and have to be consumed by the caller then. DC block output is
+ * also written to `out` unless it is nullptr; `out` must have room for all
+ * outputs, length / decimation rounded up.
+ * Returns the number of outputs.
+ */
+template <typename FIR>
+size_t fir_dc_detect(FIR &fir, filter::DCBlockFilter &dc, ObjectDetector &det,
+                     const int16_t *data, size_t length, int16_t *out = nullptr) {
+    size_t n_out{0};
+    if (out) {
+        fir.write_each(data, length, [&](int16_t sample) {
+            const int16_t y = dc.write_one(sample);
+            det.write_one(y);
+            out[n_out++] = y;
+        });
+    } else {
+        fir.write_each(data, length, [&](int16_t sample) {
+            det.write_one(dc.write_one(sample));
+            n_out++;
+        });
+    }
+    return n_out;
+}
+
+}
@@ -1,5 +1,6 @@
 #include <math.h>
 #include <string.h>
+#include <algorithm>
 #include <FreeRTOS.h>
 #include <queue.h>
 #include "message_buffer.h"
@@ -24,9 +25,31 @@ void filter::filter_init() {
     tap_stream = xMessageBufferCreate((sizeof(size_t) + sizeof(filter_tap_t))*storage_length);
 }
 
-static void filter_tap_send(int id, const int16_t *data, size_t len, bool done);
+static void filter_tap_send(int id, const filter_span_t *spans, size_t n_spans, bool done);
 
 
+EXECUTE_FROM_RAM("filter")
+size_t GenericFilter::peek(filter_span_t spans[2], size_t max_length) const {
+    const size_t length = std::min(m_out_cnt, max_length);
+    if (!length)
+        return 0;
+
+    const size_t first = std::min(length, FILTER_OUTPUT_LEN - m_out_head);
+    spans[0] = {&m_out_buf[m_out_head], first};
+    if (first == length)
+        return 1;
+    spans[1] = {&m_out_buf[0], length - first};
+    return 2;
+}
+
+int16_t *GenericFilter::out_buf() {
+    if (m_out_head + m_out_cnt > FILTER_OUTPUT_LEN) {
+        std::rotate(m_out_buf, m_out_buf + m_out_head, m_out_buf + FILTER_OUTPUT_LEN);
+        m_out_head = 0;
+    }
+    return &m_out_buf[m_out_head];
+}
+
 EXECUTE_FROM_RAM("filter")
 void GenericFilter::consume(size_t max_length) {
     size_t consume_size = std::min(m_out_cnt, max_length);
@@ -42,25 +65,27 @@ void GenericFilter::consume(size_t max_length) {
         } else {
             m_tap_len -= consume_size;
         }
-        filter_tap_send(m_tap_id, m_out_buf, consume_size, final);
+        filter_span_t spans[2];
+        size_t n_spans = peek(spans, consume_size);
+        filter_tap_send(m_tap_id, spans, n_spans, final);
     }
 
-    if (consume_size == m_out_cnt)
-        m_out_cnt = 0;
-    else {
-        memmove(m_out_buf, &m_out_buf[consume_size], sizeof(m_out_buf[0]) * (m_out_cnt - consume_size));
-        m_out_cnt = m_out_cnt - consume_size;
-    }
+    // Only the queue head moves
+    m_out_head = (m_out_head + consume_size) & FILTER_OUTPUT_MASK;
+    m_out_cnt -= consume_size;
 }
 
 // Returns requested number of samples or less
 EXECUTE_FROM_RAM("filter")
 size_t GenericFilter::read(int16_t *out, size_t max_length) {
-    size_t output_size = std::min(m_out_cnt, max_length);
-    if (!output_size)
-        return output_size;
+    filter_span_t spans[2];
+    size_t n_spans = peek(spans, max_length);
+    size_t output_size{0};
     // copy to output
-    memcpy(out, m_out_buf, output_size * sizeof(m_out_buf[0]));
+    for (size_t n = 0; n < n_spans; n++) {
+        memcpy(out + output_size, spans[n].data, spans[n].length * sizeof(m_out_buf[0]));
+        output_size += spans[n].length;
+    }
     // remove from buffer
     consume(output_size);
     return output_size;
@@ -69,13 +94,17 @@ size_t GenericFilter::read(int16_t *out, size_t max_length) {
 
 EXECUTE_FROM_RAM("fir")
 void FIRFilter::write(const int16_t *data, size_t length, size_t step) {
-    auto coefficients_size = m_coefficients.size();
+    const auto coefficients_size = m_coefficients.size();
     auto data_counter = m_data_counter;
+    auto buffer_pos = m_buffer_pos;
 
     for (size_t in_ptr = 0; in_ptr < length; in_ptr += step) {
-        // process input data
-        m_buffer[m_buffer_pos] = data[in_ptr];
-        m_buffer_pos = (m_buffer_pos + 1) & FILTER_ADDR_MASK;
+        // process input data, history is written twice
+        const int16_t sample = data[in_ptr];
+        m_buffer[buffer_pos] = sample;
+        m_buffer[buffer_pos + coefficients_size] = sample;
+        if (unlikely(++buffer_pos == coefficients_size))
+            buffer_pos = 0;
 
         // Output data each m_decimation_factor'th input cycle
         // data counter is 
@@ -87,18 +116,19 @@ void FIRFilter::write(const int16_t *data, size_t length, size_t step) {
         // Do not calculate filter output when output buffer is full
         if (likely(m_out_cnt < FILTER_OUTPUT_LEN)) {
             // put value into the buffer
-            int32_t out_val = process_one();
+            int32_t out_val = process_one(&m_buffer[buffer_pos]);
             if (out_val > INT16_MAX)
                 out_val = INT16_MAX;
             if (out_val < INT16_MIN)
                 out_val = INT16_MIN;
-            m_out_buf[m_out_cnt++] = out_val; 
+            out_push(out_val);
         } else {
             overflow_cnt++;
         }
     }
 
     m_data_counter = data_counter;
+    m_buffer_pos = buffer_pos;
 }
 
 void FIRFilter::set_coefficients(std::vector<float> coefficients, uint32_t gain_bits) {
@@ -125,30 +155,27 @@ void FIRFilter::set_coefficients(std::vector<float> coefficients, uint32_t gain_
 }
 
 
-// Calculates one sample of filter output for the last input value
+// Calculates one sample of filter output for the last input value.
+// `window` holds the last samples in order, the latest one at window[coeff_len - 1]
 EXECUTE_FROM_RAM("fir")
-int32_t FIRFilter::process_one() {
+int32_t FIRFilter::process_one(const int16_t *window) {
     if (likely(m_is_symmetric))
-        return process_one_sym();
+        return process_one_sym(window);
     // Generic filter implementation
     const auto coeff_len = m_coefficients.size();
     const auto coeff = m_coefficients.data();
-    const auto buf = &m_buffer[0];
 
     int32_t result = 0;
-    uint32_t p_data = (m_buffer_pos - 1) & FILTER_ADDR_MASK;
-    for (size_t n = 0; n < coeff_len; n++) {
-        result += (int32_t)buf[p_data] * coeff[n];
-        p_data = (p_data - 1) & FILTER_ADDR_MASK;
-    }
+    const int16_t *p_data = window + coeff_len - 1;
+    for (size_t n = 0; n < coeff_len; n++)
+        result += (int32_t)*p_data-- * coeff[n];
     return result >> m_gain_bits;
 }
 
 EXECUTE_FROM_RAM("fir")
-int32_t FIRFilter::process_one_sym() {
+int32_t FIRFilter::process_one_sym(const int16_t *window) {
     const auto coeff_len = m_coefficients.size();
     const auto coeff = m_coefficients.data();
-    const auto buf = &m_buffer[0];
 
     // for 7-tap filter:
     // coeff_len = 7
@@ -160,18 +187,15 @@ int32_t FIRFilter::process_one_sym() {
     // coeff[3] *  data[-4]
 
     int32_t result = 0;
-    // Set initial data pointers
-    uint32_t p_data1 = (m_buffer_pos - 1) & FILTER_ADDR_MASK;
-    uint32_t p_data2 = (m_buffer_pos - m_coefficients.size()) & FILTER_ADDR_MASK;
-
-    for (size_t n = 0; n < coeff_len/2; n++) {
-        // Wrap pointers over the buffer
-        result += ((int32_t)buf[p_data1] + (int32_t)buf[p_data2])  * coeff[n];
-        p_data1 = (p_data1 - 1) & FILTER_ADDR_MASK;
-        p_data2 = (p_data2 + 1) & FILTER_ADDR_MASK;
-    }
-    // Wrap pointer last time and use it as last value pointer
-    result += (int32_t)buf[p_data1] * coeff[coeff_len/2];
+    // Latest and oldest samples, the history is contiguous
+    const int16_t *p_data1 = window + coeff_len - 1;
+    const int16_t *p_data2 = window;
+
+    for (size_t n = 0; n < coeff_len/2; n++)
+        result += ((int32_t)*p_data1-- + (int32_t)*p_data2++) * coeff[n];
+    // Even length filters have no unpaired value
+    if (coeff_len & 1)
+        result += (int32_t)*p_data1 * coeff[coeff_len/2];
 
     return result >> m_gain_bits;
 }
@@ -217,7 +241,7 @@ void CICFilter<order, decimation_factor>::write(const int16_t *data, size_t leng
                 out_val = INT16_MAX;
             if (out_val < INT16_MIN)
                 out_val = INT16_MIN;
-            m_out_buf[m_out_cnt++] = out_val;
+            out_push(out_val);
         } else {
             overflow_cnt++;
         }
@@ -231,6 +255,59 @@ void CICFilter<order, decimation_factor>::write(const int16_t *data, size_t leng
 template class CICFilter<4,5>;
 
 
+template <uint8_t order /* M */, uint8_t decimation_factor /* R */, uint8_t channels>
+EXECUTE_FROM_RAM("cic")
+void InterleavedCICFilter<order, decimation_factor, channels>::write(const int16_t *data, 
+                                                                    size_t length) {
+    uint32_t data_counter = m_data_counter;
+
+    for (size_t n = 0; n + channels <= length; n += channels) {
+        int32_t stage_in[channels];
+        for (size_t ch = 0; ch < channels; ch++)
+            stage_in[ch] = data[n + ch];
+
+        // Do integrator operation
+        for (size_t ord = 0; ord < order; ord++)
+            for (size_t ch = 0; ch < channels; ch++)
+                stage_in[ch] = m_integrator[ord][ch] = stage_in[ch] + m_integrator[ord][ch];
+
+        // Do decimation
+        if (likely(--data_counter == 0))
+            data_counter = decimation_factor;
+        else
+            continue;
+
+        // Do comb
+        for (size_t ord = 0; ord < order; ord++)
+            for (size_t ch = 0; ch < channels; ch++) {
+                int32_t prev_in = stage_in[ch];
+                stage_in[ch] = stage_in[ch] - m_comb[ord][ch];
+                m_comb[ord][ch] = prev_in;
+            }
+
+        for (size_t ch = 0; ch < channels; ch++) {
+            Channel &out = m_channels[ch];
+            // Do not store filter output when output buffer is full
+            if (likely(out.m_out_cnt < FILTER_OUTPUT_LEN)) {
+                // downscale, clip and truncate
+                int32_t out_val = stage_in[ch] / (1 << m_attenuate_shift);
+                if (out_val > INT16_MAX)
+                    out_val = INT16_MAX;
+                if (out_val < INT16_MIN)
+                    out_val = INT16_MIN;
+                out.out_push(out_val);
+            } else {
+                out.overflow_cnt++;
+            }
+        }
+    }
+
+    m_data_counter = data_counter;
+}
+
+template class InterleavedCICFilter<4,5,2>;
+
+
 EXECUTE_FROM_RAM("dcblock")
 void DCBlockFilter::write(const int16_t *data, size_t length) {
     auto dc_acc = m_dc_acc;
@@ -241,20 +318,11 @@ void DCBlockFilter::write(const int16_t *data, size_t length) {
         int32_t sample = *data++;
 
         // DC removal stage
-        // https://dspguru.com/dsp/tricks/fixed-point-dc-blocking-filter-with-noise-shaping/
-        // https://www.iro.umontreal.ca/~mignotte/IFT3205/Documents/TipsAndTricks/DCBlockerAlgorithms.pdf
-        {
-            dc_acc -= dc_prev_x;
-            dc_prev_x = sample << DC_BASE_SHIFT;
-            dc_acc += dc_prev_x;
-            dc_acc -= DC_POLE_NUM*dc_prev_y; 
-            dc_prev_y = dc_acc / (1 << DC_BASE_SHIFT); // hopefully translates to ASR
-        }
-        auto int_y = dc_prev_y;
+        auto int_y = step(dc_acc, dc_prev_x, dc_prev_y, sample);
 
         if (likely(m_out_cnt < FILTER_OUTPUT_LEN)) {
             // downscale, clip and truncate
-            m_out_buf[m_out_cnt++] = int_y;
+            out_push(int_y);
         } else {
             overflow_cnt++;
         }
@@ -266,12 +334,91 @@ void DCBlockFilter::write(const int16_t *data, size_t length) {
 }
 
 
-static void filter_tap_send(int id, const int16_t *buf, size_t len, bool done) {
+BiquadCascadeFilter::BiquadCascadeFilter(const std::vector<biquad_coefficients_t> &sections,
+                                         size_t decimation_factor)
+    : GenericFilter{}, m_decimation_factor{std::max<size_t>(decimation_factor, 1)} {
+    // Rounds and clamps a coefficient to [-BIQUAD_COEFF_MAX - 1, BIQUAD_COEFF_MAX]
+    auto quantize = [](float c) -> int32_t {
+        const float v = round(c * (1 << BIQUAD_COEFF_SHIFT));
+        return std::max<float>(std::min<float>(v, BIQUAD_COEFF_MAX), -BIQUAD_COEFF_MAX - 1);
+    };
+    for (const auto &c: sections) {
+        biquad_section_t s{};
+        s.b0 = quantize(c.b0);
+        s.b1 = quantize(c.b1);
+        s.b2 = quantize(c.b2);
+        s.a1 = quantize(c.a1);
+        s.a2 = quantize(c.a2);
+        m_sections.push_back(s);
+    }
+}
+
+// Runs one section on input x, returns the output
+EXECUTE_FROM_RAM("biquad")
+int16_t BiquadCascadeFilter::process_one(biquad_section_t &s, int16_t x) {
+    // Q1.30 accumulator, starting with the error feedback.
+    // Sums are done modulo 2^32 so that only the final value has to fit
+    uint32_t acc = -((s.a1 * s.err1 + s.a2 * s.err2) >> BIQUAD_COEFF_SHIFT);
+    acc += (uint32_t)(s.b0 * x);
+    acc += (uint32_t)(s.b1 * s.x1);
+    acc += (uint32_t)(s.b2 * s.x2);
+    acc -= (uint32_t)(s.a1 * s.y1);
+    acc -= (uint32_t)(s.a2 * s.y2);
+
+    // Truncate to Q1.15, the dropped part is fed back into the next outputs
+    const int32_t acc_q30 = (int32_t)acc;
+    int32_t y = acc_q30 >> BIQUAD_COEFF_SHIFT;
+    s.err2 = s.err1;
+    s.err1 = acc_q30 - y * (1 << BIQUAD_COEFF_SHIFT);
+    if (unlikely(y > INT16_MAX))
+        y = INT16_MAX;
+    if (unlikely(y < INT16_MIN))
+        y = INT16_MIN;
+
+    s.x2 = s.x1;
+    s.x1 = x;
+    s.y2 = s.y1;
+    s.y1 = y;
+    return y;
+}
+
+EXECUTE_FROM_RAM("biquad")
+void BiquadCascadeFilter::write(const int16_t *data, size_t length, size_t step) {
+    auto data_counter = m_data_counter;
+
+    for (size_t in_ptr = 0; in_ptr < length; in_ptr += step) {
+        // All sections run on every input to keep their state
+        int16_t sample = data[in_ptr];
+        for (auto &s: m_sections)
+            sample = process_one(s, sample);
+
+        // Output data each m_decimation_factor'th input cycle
+        if (likely(--data_counter == 0))
+            data_counter = m_decimation_factor;
+        else
+            continue;
+
+        if (likely(m_out_cnt < FILTER_OUTPUT_LEN)) {
+            out_push(sample);
+        } else {
+            overflow_cnt++;
+        }
+    }
+
+    m_data_counter = data_counter;
+}
+
+
+static void filter_tap_send(int id, const filter_span_t *spans, size_t n_spans, bool done) {
     filter_tap_t tap{};
+    size_t len{0};
+    for (size_t n = 0; n < n_spans; n++) {
+        memcpy(tap.buf + len, spans[n].data, spans[n].length * sizeof(*tap.buf));
+        len += spans[n].length;
+    }
     tap.id = id;
     tap.len = len;
     tap.done = done ? 1 : 0;
-    memcpy(tap.buf, buf, len * sizeof(*buf));
     xMessageBufferSend(tap_stream, &tap, sizeof(tap), portMAX_DELAY);
 }
     
@@ -2,23 +2,46 @@
 #include <stdint.h>
 #include <vector>
 #include <deque>
+#include <array>
+#include <utility>
 
 #include "cic.h"
 
 namespace filter {
 
+// Output queue is a ring, length is a power of two
 constexpr size_t FILTER_OUTPUT_LEN{128};
+constexpr size_t FILTER_OUTPUT_MASK{FILTER_OUTPUT_LEN - 1};
+static_assert((FILTER_OUTPUT_LEN & FILTER_OUTPUT_MASK) == 0, "output length must be a power of two");
 
 void filter_init();
 
+// Contiguous part of a filter output queue
+typedef struct {
+    const int16_t *data;
+    size_t length;
+} filter_span_t;
+
 class GenericFilter {
 public:
     // Reads max_length output data into out, returns number of entries filled
     size_t read(int16_t *out, size_t max_length);
     // Returns output queue length
     size_t out_len() { return m_out_cnt; }
-    // Returns pointer to the output values
-    int16_t *out_buf() { return m_out_buf; }
+    // Fills 1 or 2 spans (0 if empty) with up to max_length first output
+    // entries in order, returns number of spans. Entries stay in the queue
+    size_t peek(filter_span_t spans[2], size_t max_length = FILTER_OUTPUT_LEN) const;
+    // Calls f(data, length) for each span peek() returns
+    template <typename F>
+    void peek_each(size_t max_length, F &&f) const {
+        filter_span_t spans[2];
+        const size_t n_spans = peek(spans, max_length);
+        for (size_t n = 0; n < n_spans; n++)
+            f(spans[n].data, spans[n].length);
+    }
+    // Returns pointer to the output values. Moves them to the buffer start
+    // if the queue wraps, peek() does not
+    int16_t *out_buf();
     // Removes max_length first output entries
     void  consume(size_t max_length);
     // Output overflow counter
@@ -30,6 +53,20 @@ public:
         m_tap_active = true;
     }
 protected:
+    // Appends an output value, the queue must not be full
+    void out_push(int16_t value) { m_out_buf[(m_out_head + m_out_cnt++) & FILTER_OUTPUT_MASK] = value; }
+    // Appends an output value only while the filter tap is active, for outputs
+    // which are passed on without the queue
+    void out_tap(int16_t value) {
+        if (__builtin_expect(m_tap_active, 0)) {
+            if (m_out_cnt < FILTER_OUTPUT_LEN)
+                out_push(value);
+            else
+                overflow_cnt++;
+        }
+    }
+
+    size_t      m_out_head{0};  // index of the first output entry
     size_t      m_out_cnt{0};
     int16_t     m_out_buf[FILTER_OUTPUT_LEN]{};
 private:
@@ -54,24 +91,280 @@ public:
     ~FIRFilter() = default;
 
     void write(const int16_t *data, size_t length, size_t step = 1);
+    // Same as write(), but each output is passed to f(int16_t) as soon as it
+    // is calculated. Outputs are queued only while the filter tap is active
+    template <typename F>
+    void write_each(const int16_t *data, size_t length, F &&f) {
+        const auto coefficients_size = m_coefficients.size();
+        auto data_counter = m_data_counter;
+        auto buffer_pos = m_buffer_pos;
+
+        for (size_t in_ptr = 0; in_ptr < length; in_ptr++) {
+            const int16_t sample = data[in_ptr];
+            m_buffer[buffer_pos] = sample;
+            m_buffer[buffer_pos + coefficients_size] = sample;
+            if (__builtin_expect(++buffer_pos == coefficients_size, 0))
+                buffer_pos = 0;
+
+            if (__builtin_expect(--data_counter == 0, 1))
+                data_counter = m_decimation_factor;
+            else
+                continue;
+
+            int32_t out_val = process_one(&m_buffer[buffer_pos]);
+            if (out_val > INT16_MAX)
+                out_val = INT16_MAX;
+            if (out_val < INT16_MIN)
+                out_val = INT16_MIN;
+            out_tap(out_val);
+            f((int16_t)out_val);
+        }
+
+        m_data_counter = data_counter;
+        m_buffer_pos = buffer_pos;
+    }
 
     // debug functions
     void set_symmetric(bool sym) { m_is_symmetric = sym; }
-    void set_buffer_pos(size_t pos) { m_buffer_pos = std::min(pos, FILTER_BUFFER_SIZE-1);};
+    void set_buffer_pos(size_t pos) { m_buffer_pos = pos % std::max<size_t>(m_coefficients.size(), 1);};
     
     bool is_symmetric() { return m_is_symmetric; }
 private:
     std::vector<int32_t> m_coefficients;
     size_t      m_decimation_factor{1};
     bool        m_is_symmetric{false};
-    int16_t     m_buffer[FILTER_BUFFER_SIZE]{};
+    // Input history, each sample is written at pos and pos + number of taps,
+    // so that the last samples are always contiguous at m_buffer[m_buffer_pos]
+    int16_t     m_buffer[2*FILTER_BUFFER_SIZE]{};
     size_t      m_buffer_pos{0};
     size_t      m_data_counter{0};
     uint32_t    m_gain_bits;
 
     void set_coefficients(std::vector<float> coefficients, uint32_t m_gain_bits);
-    int32_t process_one();
-    int32_t process_one_sym();
+    int32_t process_one(const int16_t *window);
+    int32_t process_one_sym(const int16_t *window);
+};
+
+// Rounds a coefficient to fixed point with `gain_bits` fractional bits, as round() does
+constexpr int32_t fir_quantize(float coefficient, uint32_t gain_bits) {
+    const double scaled = (double)coefficient * (1UL << gain_bits);
+    return (int32_t)(scaled >= 0 ? scaled + 0.5 : scaled - 0.5);
+}
+
+/*
+ * FIR filter with `Coefficients` known at compile time: quantization and
+ * the symmetry check are done by the compiler, and the MACs of an output are
+ * fully unrolled, folded for symmetric filters. Output is the same as of
+ * FIRFilter with the same coefficients.
+ */
+template <size_t Taps, size_t Decimation, uint32_t GainBits,
+          const std::array<float, Taps> &Coefficients>
+class StaticFIRFilter final : public GenericFilter {
+public:
+    static_assert(Taps > 0 && Taps <= MAX_FILTER_ORDER, "unsupported filter length");
+    static_assert(Decimation > 0, "decimation must be positive");
+
+    StaticFIRFilter() : GenericFilter{} {}
+    ~StaticFIRFilter() = default;
+
+    void write(const int16_t *data, size_t length, size_t step = 1) {
+        auto data_counter = m_data_counter;
+        auto buffer_pos = m_buffer_pos;
+
+        for (size_t in_ptr = 0; in_ptr < length; in_ptr += step) {
+            // History is written twice, see FIRFilter
+            const int16_t sample = data[in_ptr];
+            m_buffer[buffer_pos] = sample;
+            m_buffer[buffer_pos + Taps] = sample;
+            if (__builtin_expect(++buffer_pos == Taps, 0))
+                buffer_pos = 0;
+
+            if (__builtin_expect(--data_counter == 0, 1))
+                data_counter = Decimation;
+            else
+                continue;
+
+            if (__builtin_expect(m_out_cnt < FILTER_OUTPUT_LEN, 1)) {
+                int32_t out_val = process_one(&m_buffer[buffer_pos], std::make_index_sequence<Taps/2>{});
+                if (out_val > INT16_MAX)
+                    out_val = INT16_MAX;
+                if (out_val < INT16_MIN)
+                    out_val = INT16_MIN;
+                out_push(out_val);
+            } else {
+                overflow_cnt++;
+            }
+        }
+
+        m_data_counter = data_counter;
+        m_buffer_pos = buffer_pos;
+    }
+
+    // See FIRFilter::write_each()
+    template <typename F>
+    void write_each(const int16_t *data, size_t length, F &&f) {
+        auto data_counter = m_data_counter;
+        auto buffer_pos = m_buffer_pos;
+
+        for (size_t in_ptr = 0; in_ptr < length; in_ptr++) {
+            const int16_t sample = data[in_ptr];
+            m_buffer[buffer_pos] = sample;
+            m_buffer[buffer_pos + Taps] = sample;
+            if (__builtin_expect(++buffer_pos == Taps, 0))
+                buffer_pos = 0;
+
+            if (__builtin_expect(--data_counter == 0, 1))
+                data_counter = Decimation;
+            else
+                continue;
+
+            int32_t out_val = process_one(&m_buffer[buffer_pos], std::make_index_sequence<Taps/2>{});
+            if (out_val > INT16_MAX)
+                out_val = INT16_MAX;
+            if (out_val < INT16_MIN)
+                out_val = INT16_MIN;
+            out_tap(out_val);
+            f((int16_t)out_val);
+        }
+
+        m_data_counter = data_counter;
+        m_buffer_pos = buffer_pos;
+    }
+
+    static constexpr bool is_symmetric() { return m_is_symmetric; }
+
+private:
+    static constexpr std::array<int32_t, Taps> quantize() {
+        std::array<int32_t, Taps> out{};
+        for (size_t n = 0; n < Taps; n++)
+            out[n] = fir_quantize(Coefficients[n], GainBits);
+        return out;
+    }
+
+    static constexpr bool check_symmetric() {
+        for (size_t n = 0; n < Taps/2; n++)
+            if (m_coefficients[n] != m_coefficients[Taps - 1 - n])
+                return false;
+        return true;
+    }
+
+    static constexpr std::array<int32_t, Taps> m_coefficients{quantize()};
+    static constexpr bool m_is_symmetric{check_symmetric()};
+
+    // `window` holds the last samples in order, the latest one at window[Taps - 1]
+    template <size_t... N>
+    static int32_t process_one(const int16_t *window, std::index_sequence<N...>) {
+        int32_t result;
+        if (m_is_symmetric) {
+            result = (0 + ... + (((int32_t)window[Taps - 1 - N] + window[N]) * m_coefficients[N]));
+            if (Taps & 1)
+                result += (int32_t)window[Taps/2] * m_coefficients[Taps/2];
+        } else {
+            result = (0 + ... + ((int32_t)window[Taps - 1 - N] * m_coefficients[N] +
+                                 (int32_t)window[N] * m_coefficients[Taps - 1 - N]));
+            if (Taps & 1)
+                result += (int32_t)window[Taps/2] * m_coefficients[Taps/2];
+        }
+        return result >> GainBits;
+    }
+
+    int16_t     m_buffer[2*Taps]{};
+    size_t      m_buffer_pos{0};
+    size_t      m_data_counter{1};
+};
+
+/*
+ * Half-band lowpass filter with decimation 2. Every other coefficient of a
+ * half-band filter is zero, apart from the center one, so an output takes
+ * one MAC per symmetric pair of non-zero coefficients plus one for the center
+ * tap, (Taps + 5)/4 in total. `Coefficients` are checked at compile time to
+ * be symmetric with zeros in place. Output is the same as of FIRFilter with
+ * the same coefficients and decimation 2.
+ */
+template <size_t Taps, uint32_t GainBits, const std::array<float, Taps> &Coefficients>
+class HalfBandFilter final : public GenericFilter {
+public:
+    static_assert(Taps % 4 == 3 && Taps <= MAX_FILTER_ORDER, "half-band filter length must be 4k+3");
+
+    static constexpr size_t DECIMATION{2};
+    // Multiplications per output
+    static constexpr size_t MACS{(Taps + 5)/4};
+
+    HalfBandFilter() : GenericFilter{} {
+        static_assert(check_half_band(), "coefficients are not a half-band filter");
+    }
+    ~HalfBandFilter() = default;
+
+    void write(const int16_t *data, size_t length, size_t step = 1) {
+        auto data_counter = m_data_counter;
+        auto buffer_pos = m_buffer_pos;
+
+        for (size_t in_ptr = 0; in_ptr < length; in_ptr += step) {
+            // History is written twice, see FIRFilter
+            const int16_t sample = data[in_ptr];
+            m_buffer[buffer_pos] = sample;
+            m_buffer[buffer_pos + Taps] = sample;
+            if (__builtin_expect(++buffer_pos == Taps, 0))
+                buffer_pos = 0;
+
+            if (--data_counter == 0)
+                data_counter = DECIMATION;
+            else
+                continue;
+
+            if (__builtin_expect(m_out_cnt < FILTER_OUTPUT_LEN, 1)) {
+                int32_t out_val = process_one(&m_buffer[buffer_pos], std::make_index_sequence<N_PAIRS>{});
+                if (out_val > INT16_MAX)
+                    out_val = INT16_MAX;
+                if (out_val < INT16_MIN)
+                    out_val = INT16_MIN;
+                out_push(out_val);
+            } else {
+                overflow_cnt++;
+            }
+        }
+
+        m_data_counter = data_counter;
+        m_buffer_pos = buffer_pos;
+    }
+
+private:
+    static constexpr size_t CENTER{Taps/2};
+    // Pairs of non-zero coefficients, at odd distances from the center
+    static constexpr size_t N_PAIRS{(Taps + 1)/4};
+
+    static constexpr bool check_half_band() {
+        for (size_t n = 0; n < Taps; n++) {
+            const int32_t c = fir_quantize(Coefficients[n], GainBits);
+            if (c != fir_quantize(Coefficients[Taps - 1 - n], GainBits))
+                return false;
+            if (n != CENTER && !((CENTER - n) & 1) && c != 0)
+                return false;
+        }
+        return true;
+    }
+
+    static constexpr std::array<int32_t, N_PAIRS> quantize_pairs() {
+        std::array<int32_t, N_PAIRS> out{};
+        for (size_t k = 0; k < N_PAIRS; k++)
+            out[k] = fir_quantize(Coefficients[CENTER - 1 - 2*k], GainBits);
+        return out;
+    }
+
+    static constexpr std::array<int32_t, N_PAIRS> m_pairs{quantize_pairs()};
+    static constexpr int32_t m_center{fir_quantize(Coefficients[CENTER], GainBits)};
+
+    // `window` holds the last samples in order, the latest one at window[Taps - 1]
+    template <size_t... K>
+    static int32_t process_one(const int16_t *window, std::index_sequence<K...>) {
+        int32_t result = (int32_t)window[CENTER] * m_center;
+        result += (0 + ... + (((int32_t)window[CENTER - 1 - 2*K] + window[CENTER + 1 + 2*K]) * m_pairs[K]));
+        return result >> GainBits;
+    }
+
+    int16_t     m_buffer[2*Taps]{};
+    size_t      m_buffer_pos{0};
+    size_t      m_data_counter{1};
 };
 
 constexpr size_t MAX_CIC_ORDER{8};
@@ -103,6 +396,98 @@ private:
     float       m_gain;
 };
 
+/*
+ * CIC filters for `channels` interleaved inputs (e.g. round-robin ADC samples),
+ * same as a CICFilter per channel. Input is read in one pass, integrator and
+ * comb state is kept per stage for all channels, and channel outputs are
+ * produced in lockstep.
+ */
+template <uint8_t order /* M */, uint8_t decimation_factor /* R */, uint8_t channels>
+class InterleavedCICFilter final {
+public:
+    // Output of one channel
+    class Channel final : public GenericFilter {
+        friend class InterleavedCICFilter;
+    };
+
+    InterleavedCICFilter() {
+        uint32_t n = 1;
+        int _order = order;
+        while (_order--)
+            n *= decimation_factor;
+        m_attenuate_shift = 32 - __builtin_clz(n) - 1;
+        m_gain = (float)n / (1UL << m_attenuate_shift);
+        m_data_counter = decimation_factor;
+    }
+
+    ~InterleavedCICFilter() = default;
+
+    // Processes `length` samples, channel samples are interleaved
+    // starting from channel 0; length is a multiple of `channels`
+    void write(const int16_t *data, size_t length);
+    // Returns unattenuated gain of this filter
+    float gain() { return m_gain; }
+    Channel &channel(size_t n) { return m_channels[n]; }
+
+private:
+    int32_t     m_integrator[order][channels]{};
+    int32_t     m_comb[order][channels]{};
+    Channel     m_channels[channels];
+    uint8_t     m_data_counter;
+    uint8_t     m_attenuate_shift{1};
+    float       m_gain;
+};
+
+// Biquad section coefficients, normalized to a0 = 1:
+// y[n] = b0*x[n] + b1*x[n-1] + b2*x[n-2] - a1*y[n-1] - a2*y[n-2]
+typedef struct {
+    float b0, b1, b2, a1, a2;
+} biquad_coefficients_t;
+
+// Fractional bits of biquad coefficients
+constexpr uint32_t BIQUAD_COEFF_SHIFT{14};
+// Biquad coefficients are kept in 32 bits and cover [-4, 4), so that b1 = 2*b0
+// and a1 near +-2 of sections with zeros or poles near DC or Nyquist fit.
+// Products with 16-bit samples stay below 2^31
+constexpr int32_t BIQUAD_COEFF_MAX{(4 << BIQUAD_COEFF_SHIFT) - 1};
+
+/*
+ * Cascade of IIR biquad sections in direct form I, with 14 fractional bits
+ * of coefficients (see BIQUAD_COEFF_MAX, coefficients out of range are
+ * clamped), 16-bit state and Q1.30 accumulators. Truncation errors of the section
+ * outputs are fed back through the poles (noise shaping, as in DCBlockFilter),
+ * so that the recursion keeps the accumulator precision and decays to zero
+ * without limit cycles. Sections run on every input, an output is produced each
+ * `decimation_factor`'th input. Phase is not linear.
+ * It is an opt-in alternative to FIRFilter where only the magnitude response
+ * matters: without decimation a 4th order lowpass takes 14 MACs per output
+ * against 25 of the 49-tap FIR. The recursion runs on every input though, so
+ * with decimation 3 it is no cheaper than the FIR.
+ */
+class BiquadCascadeFilter final : public GenericFilter {
+public:
+    BiquadCascadeFilter(const std::vector<biquad_coefficients_t> &sections,
+                        size_t decimation_factor = 1);
+    ~BiquadCascadeFilter() = default;
+
+    void write(const int16_t *data, size_t length, size_t step = 1);
+
+    size_t get_n_sections() const { return m_sections.size(); }
+private:
+    typedef struct {
+        int32_t b0, b1, b2, a1, a2; // 14 fractional bits
+        int16_t x1, x2;             // last inputs
+        int16_t y1, y2;             // last outputs
+        int32_t err1, err2;         // truncation errors of the last outputs
+    } biquad_section_t;
+
+    static int16_t process_one(biquad_section_t &s, int16_t x);
+
+    std::vector<biquad_section_t> m_sections;
+    size_t      m_decimation_factor{1};
+    size_t      m_data_counter{1};
+};
+
 // DC filter pole would be (1 << DC_BASE_SHIFT - DC_POLE_NUM)/(1 << DC_BASE_SHIFT)
 // e.g. (32768 - 4)/32768 = 0.999878
 constexpr uint32_t DC_BASE_SHIFT{15};
@@ -114,10 +499,29 @@ public:
     ~DCBlockFilter() = default;
 
     void write(const int16_t *data, size_t length);
+    // Filters one sample and returns the output, which is queued only while
+    // the filter tap is active
+    int16_t write_one(int16_t sample) {
+        const int16_t out_val = step(m_dc_acc, m_dc_prev_x, m_dc_prev_y, sample);
+        out_tap(out_val);
+        return out_val;
+    }
 
     void preinit(int16_t val) { m_dc_prev_x = val * (1 << DC_BASE_SHIFT); }
 
 private:
+    // DC removal recurrence, returns the new output
+    // https://dspguru.com/dsp/tricks/fixed-point-dc-blocking-filter-with-noise-shaping/
+    // https://www.iro.umontreal.ca/~mignotte/IFT3205/Documents/TipsAndTricks/DCBlockerAlgorithms.pdf
+    static int32_t step(int32_t &dc_acc, int32_t &dc_prev_x, int32_t &dc_prev_y, int32_t sample) {
+        dc_acc -= dc_prev_x;
+        dc_prev_x = sample << DC_BASE_SHIFT;
+        dc_acc += dc_prev_x;
+        dc_acc -= DC_POLE_NUM*dc_prev_y;
+        dc_prev_y = dc_acc / (1 << DC_BASE_SHIFT); // hopefully translates to ASR
+        return dc_prev_y;
+    }
+
     // DC removal internal data
     int32_t m_dc_acc{0};
     int32_t m_dc_prev_x{0};
@@ -0,0 +1,103 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <tuple>
+#include <utility>
+#include "filter.h"
+
+namespace filter {
+
+// Decimation factor of a pipeline stage, 1 for stages without decimation
+template <typename Stage>
+struct stage_decimation {
+    static constexpr size_t value{1};
+};
+
+template <uint8_t order, uint8_t decimation_factor>
+struct stage_decimation<CICFilter<order, decimation_factor>> {
+    static constexpr size_t value{decimation_factor};
+};
+
+template <size_t Taps, size_t Decimation, uint32_t GainBits,
+          const std::array<float, Taps> &Coefficients>
+struct stage_decimation<StaticFIRFilter<Taps, Decimation, GainBits, Coefficients>> {
+    static constexpr size_t value{Decimation};
+};
+
+template <size_t Taps, uint32_t GainBits, const std::array<float, Taps> &Coefficients>
+struct stage_decimation<HalfBandFilter<Taps, GainBits, Coefficients>> {
+    static constexpr size_t value{HalfBandFilter<Taps, GainBits, Coefficients>::DECIMATION};
+};
+
+// Stages pass their output on once they have at least this many samples
+constexpr size_t PIPELINE_MIN_DRAIN{16};
+
+/*
+ * Chain of filter stages with static dispatch, e.g.
+ * Pipeline<CICFilter<4,5>, StaticFIRFilter<...>, DCBlockFilter, ObjectDetector>.
+ * Every stage but the last one is a GenericFilter; the last one is anything
+ * with write(const int16_t *, size_t). Input is processed in blocks sized
+ * so that no stage output can overflow, and after each block stages pass
+ * their output to the next one in place, as peek() spans. Stages with less
+ * than PIPELINE_MIN_DRAIN samples keep them until the next block or flush().
+ * FIRFilter (runtime coefficients) has decimation 1 for the block size,
+ * which is the safe side.
+ */
+template <typename... Stages>
+class Pipeline final {
+public:
+    static_assert(sizeof...(Stages) > 0, "pipeline needs a stage");
+
+    static constexpr size_t N_STAGES{sizeof...(Stages)};
+    // Total decimation of the chain
+    static constexpr size_t DECIMATION{(stage_decimation<Stages>::value * ...)};
+    // Input block length. A stage gets no more samples than the previous one
+    // outputs, and every filter stage may hold up to PIPELINE_MIN_DRAIN more
+    static constexpr size_t BLOCK_LEN{(FILTER_OUTPUT_LEN - PIPELINE_MIN_DRAIN * (N_STAGES - 1)) *
+                                      stage_decimation<std::tuple_element_t<0, std::tuple<Stages...>>>::value};
+    static_assert(PIPELINE_MIN_DRAIN * (N_STAGES - 1) < FILTER_OUTPUT_LEN, "too many pipeline stages");
+
+    Pipeline() = default;
+    explicit Pipeline(Stages... stages) : m_stages{std::move(stages)...} {}
+    ~Pipeline() = default;
+
+    void write(const int16_t *data, size_t length) {
+        while (length) {
+            const size_t block = std::min(length, BLOCK_LEN);
+            std::get<0>(m_stages).write(data, block);
+            drain<1>(PIPELINE_MIN_DRAIN);
+            data += block;
+            length -= block;
+        }
+    }
+
+    // Passes all samples held by stages down to the last one
+    void flush() { drain<1>(1); }
+
+    template <size_t N>
+    auto &stage() { return std::get<N>(m_stages); }
+    auto &last() { return std::get<N_STAGES - 1>(m_stages); }
+
+private:
+    // Passes output of stage N - 1 to stage N if there are at least `min_length`
+    // samples, and so on to the end
+    template <size_t N>
+    void drain(size_t min_length) {
+        if constexpr (N < N_STAGES) {
+            auto &from = std::get<N - 1>(m_stages);
+            auto &to = std::get<N>(m_stages);
+            const size_t length = from.out_len();
+            if (length >= min_length) {
+                from.peek_each(length, [&to](const int16_t *data, size_t n) {
+                    to.write(data, n);
+                });
+                from.consume(length);
+            }
+            drain<N + 1>(min_length);
+        }
+    }
+
+    std::tuple<Stages...> m_stages;
+};
+
+}
@@ -1,9 +1,15 @@
 #include <string.h>
+#include <algorithm>
 #include <FreeRTOS.h>
 #include <task.h>
 #include "adc.h"
 #include "filter.h"
+#include "pipeline.h"
+#include "detector.h"
+#include "detector_stage.h"
 #include "correlator.h"
+#include "compact.h"
+#include "executor.h"
 #include "cli.h"
 #include "cli_out.h"
 #include "benchmark.h"
@@ -50,6 +56,26 @@ void filter_benchmark_cic_cpp(size_t rounds, int stage) {
     rx_buf[64] = 1000;
     rx_buf[65] = 1000;
 
+    if ((stage == 2) || (stage == 3)) {
+        // analog_task setup with two inputs interleaved in the DMA buffer:
+        // stage 2 - a filter per channel over strided input, 3 - interleaved filter
+        filter::CICFilter</* M */4, /* R */5> filter_first_b;
+        filter::InterleavedCICFilter</* M */4, /* R */5, 2> filter_both;
+        while (rounds--) {
+            if (stage == 2) {
+                filter_first.write(rx_buf, ADC_BUF_LEN, 2);
+                filter_first_b.write(rx_buf + 1, ADC_BUF_LEN, 2);
+                filter_first.consume(filter_first.out_len());
+                filter_first_b.consume(filter_first_b.out_len());
+            } else {
+                filter_both.write(rx_buf, ADC_BUF_LEN);
+                filter_both.channel(0).consume(filter_both.channel(0).out_len());
+                filter_both.channel(1).consume(filter_both.channel(1).out_len());
+            }
+        }
+        return;
+    }
+
     while (rounds--) {
         size_t len;
 
@@ -134,7 +160,7 @@ void filter_benchmark_cic_c(size_t rounds, int stage) {
 // length = 47
 // Fout 16kHz after decimation=3 
 
-static std::vector<float> fir_lp_48k_5k
+static constexpr std::array<float, 49> fir_lp_48k_5k_c
 {
      -0.000393, -0.000876, -0.001113, -0.000412,
      0.001640, 0.004554, 0.006716, 0.006048,
@@ -151,11 +177,10 @@ static std::vector<float> fir_lp_48k_5k
      -0.000393,
 };
 
-void filter_benchmark_fir(size_t rounds, int stage) {
-    // Second-stage lowpass filters with passband 5kHz and decimation = 3
-    // Has output rate of 16ksps
-    filter::FIRFilter filter_second(fir_lp_48k_5k, 3);
-    
+static std::vector<float> fir_lp_48k_5k(fir_lp_48k_5k_c.cbegin(), fir_lp_48k_5k_c.cend());
+
+template <typename Filter>
+static void filter_benchmark_fir_run(Filter &filter_second, size_t rounds, int stage) {
     constexpr size_t out_buf_len{ADC_BUF_LEN};
     int16_t out_buf[out_buf_len];
     int16_t rx_buf[64];
@@ -178,6 +203,133 @@ void filter_benchmark_fir(size_t rounds, int stage) {
     }
 }
 
+// Half-band lowpass with passband 5kHz and decimation = 2 at 50ksps input,
+// Kaiser window beta = 6
+// Stopband 20kHz
+// Stopband attenuation 61dB with 12-bit coefficients, same as of fir_lp_48k_5k
+static constexpr std::array<float, 15> half_band_50k_5k_c
+{
+    -0.000676, 0.000000, 0.012712, 0.000000, -0.062710, 0.000000, 0.300794,
+    0.499759,
+    0.300794, 0.000000, -0.062710, 0.000000, 0.012712, 0.000000, -0.000676
+};
+
+// 4th order Butterworth lowpass with passband 5kHz at 50ksps
+// Attenuation 18dB at 8kHz, 55dB at 16kHz
+static std::vector<filter::biquad_coefficients_t> biquad_50k_5k
+{
+    {0.06188520, 0.12377039, 0.06188520, -1.04859958, 0.29614036},
+    {0.07795634, 0.15591268, 0.07795634, -1.32091344, 0.63273880},
+};
+
+void filter_benchmark_fir(size_t rounds, int stage) {
+    // Second-stage lowpass filters with passband 5kHz and decimation = 3
+    // Has output rate of 16ksps
+    // stage 2 - same filter with compile-time coefficients
+    // stage 3 - half-band filter with decimation = 2, output rate of 25ksps
+    // stage 4 - biquad cascade with decimation = 3, runs on every input
+    if (stage == 4) {
+        filter::BiquadCascadeFilter filter_second(biquad_50k_5k, 3);
+        // 5 coefficients and 2 error feedback terms per section
+        cli_info("MACs/output %d", 7 * filter_second.get_n_sections() * 3);
+        filter_benchmark_fir_run(filter_second, rounds, stage);
+    } else if (stage == 3) {
+        using HalfBand = filter::HalfBandFilter<half_band_50k_5k_c.size(), 12, half_band_50k_5k_c>;
+        HalfBand filter_second;
+        cli_info("MACs/output %d", HalfBand::MACS);
+        filter_benchmark_fir_run(filter_second, rounds, stage);
+    } else if (stage == 2) {
+        filter::StaticFIRFilter<fir_lp_48k_5k_c.size(), 3, 12, fir_lp_48k_5k_c> filter_second;
+        cli_info("MACs/output %d", (fir_lp_48k_5k_c.size() + 1)/2);
+        filter_benchmark_fir_run(filter_second, rounds, stage);
+    } else {
+        filter::FIRFilter filter_second(fir_lp_48k_5k, 3);
+        // Symmetric filter, pairs and the middle tap
+        cli_info("MACs/output %d", (fir_lp_48k_5k.size() + 1)/2);
+        filter_benchmark_fir_run(filter_second, rounds, stage);
+    }
+}
+
+
+// Single-channel signal chain CIC -> FIR -> DC block -> detector
+// stage 0 - hand-wired stages, as in analog_task
+// stage 1 - same filters in a Pipeline
+// stage 2 - Pipeline with compile-time FIR coefficients
+// stage 3 - fused FIR, DC block and detector stage, as in analog_task
+template <typename Pipeline>
+static void filter_benchmark_chain_run(Pipeline &pipeline, const int16_t *rx_buf, size_t rounds) {
+    while (rounds--)
+        pipeline.write(rx_buf, ADC_BUF_LEN);
+}
+
+void filter_benchmark_chain(size_t rounds, int stage) {
+    int16_t rx_buf[ADC_BUF_LEN];
+
+    memset(rx_buf, 0, sizeof(rx_buf));
+    rx_buf[0] = 1000;
+    rx_buf[1] = 1000;
+    rx_buf[32] = 1000;
+    rx_buf[33] = 1000;
+    rx_buf[64] = 1000;
+    rx_buf[65] = 1000;
+
+    if (stage == 1) {
+        filter::Pipeline<filter::CICFilter<4,5>, filter::FIRFilter, filter::DCBlockFilter,
+                         detector::ObjectDetector> pipeline{
+            {}, filter::FIRFilter(fir_lp_48k_5k, 3), {}, detector::ObjectDetector(8, 10)};
+        filter_benchmark_chain_run(pipeline, rx_buf, rounds);
+        return;
+    }
+    if (stage == 2) {
+        filter::Pipeline<filter::CICFilter<4,5>,
+                         filter::StaticFIRFilter<fir_lp_48k_5k_c.size(), 3, 12, fir_lp_48k_5k_c>,
+                         filter::DCBlockFilter, detector::ObjectDetector> pipeline{
+            {}, {}, {}, detector::ObjectDetector(8, 10)};
+        filter_benchmark_chain_run(pipeline, rx_buf, rounds);
+        return;
+    }
+
+    filter::CICFilter<4,5> filter_first;
+    filter::FIRFilter filter_second(fir_lp_48k_5k, 3);
+    filter::DCBlockFilter filter_dc;
+    detector::ObjectDetector det(8, 10);
+
+    while (rounds--) {
+        filter_first.write(rx_buf, ADC_BUF_LEN);
+
+        size_t first_fill = filter_first.out_len();
+        if (stage == 3) {
+            if (first_fill >= 16) {
+                filter_first.peek_each(first_fill, [&](const int16_t *data, size_t length) {
+                    detector::fir_dc_detect(filter_second, filter_dc, det, data, length);
+                });
+                filter_first.consume(first_fill);
+            }
+            continue;
+        }
+        if (first_fill >= 16) {
+            filter_first.peek_each(first_fill, [&](const int16_t *data, size_t length) {
+                filter_second.write(data, length);
+            });
+            filter_first.consume(first_fill);
+        }
+
+        size_t second_fill = filter_second.out_len();
+        if (second_fill >= 16) {
+            filter_second.peek_each(second_fill, [&](const int16_t *data, size_t length) {
+                filter_dc.write(data, length);
+            });
+            filter_second.consume(second_fill);
+            filter_dc.peek_each(second_fill, [&](const int16_t *data, size_t length) {
+                det.write(data, length);
+            });
+            filter_dc.consume(second_fill);
+        }
+    }
+}
+
+// Executor of the parallel correlator stages, lives across benchmark runs
+static correlator::Executor *cor_executor{nullptr};
 
 void correlator_benchmark(size_t rounds, int stage) {
     constexpr unsigned int fs{16000};
@@ -187,7 +339,8 @@ void correlator_benchmark(size_t rounds, int stage) {
     constexpr unsigned int offset_a_max{350*ms};
     constexpr unsigned int buf_fill{700*ms};
 
-    correlator::CircularBuffer buf_a(buf_fill); // 0.7s
+    // stage 8 - same as stage 2 over a mirrored buffer
+    correlator::CircularBuffer buf_a(buf_fill, stage == 8); // 0.7s
     correlator::CircularBuffer buf_b(300*ms);  // 0.3s
     int16_t buf1[16];
     int16_t buf2[16];
@@ -217,6 +370,116 @@ void correlator_benchmark(size_t rounds, int stage) {
             buf_b.write(buf1, 16);
     }
 
+    if (stage == 5) {
+        // Bounded peak search, hinted with the previous peak
+        int32_t hint{-1};
+        while (rounds--) {
+            auto ret = correlator::correlate_max_bounded(buf_a, buf_b, offset_a_min, offset_a_max, 
+                                                         buf_b.get_capacity(), hint);
+            hint = ret.first;
+        }
+        return;
+    }
+
+    if (stage == 6) {
+        // Coarse-to-fine peak search in correlator_task setup
+        while (rounds--)
+            correlator::correlate_coarse_fine(buf_a, buf_a, 4*ms, 100*ms, 500*ms);
+        return;
+    }
+
+    if (stage == 7) {
+        // Same as stage 2 with an inlined callback, difference is the per-offset call cost
+        int64_t peak{0};
+        while (rounds--)
+            correlator::correlate(buf_a, buf_a, 4*ms, 100*ms, 500*ms, [&](int32_t /*offset*/, int64_t sum) {
+                peak = std::max(peak, sum);
+            }, correlator::CORRELATE_DIRECT);
+        return;
+    }
+
+    if ((stage == 9) || (stage == 10)) {
+        // correlator_task setup over int8 (9) or packed 12-bit (10) storage
+        correlator::Int8CircularBuffer buf_8(buf_fill, 3);
+        correlator::Packed12CircularBuffer buf_12(buf_fill);
+        for (const auto &chunk: buf_a.get_data_chunks(-(int)buf_fill, buf_fill)) {
+            buf_8.write(chunk.start, chunk.length);
+            buf_12.write(chunk.start, chunk.length);
+        }
+        std::vector<int64_t> out(96*ms);
+        while (rounds--) {
+            if (stage == 9)
+                correlator::correlate_into(buf_8, buf_8, 4*ms, 100*ms, 500*ms, out.data());
+            else
+                correlator::correlate_into(buf_12, buf_12, 4*ms, 100*ms, 500*ms, out.data());
+        }
+        return;
+    }
+
+    if ((stage == 11) || (stage == 12)) {
+        // correlator_task full scan with A->B bins, fused (11) or as two binned runs (12)
+        correlator::CircularBuffer buf_c(buf_fill);
+        for (const auto &chunk: buf_a.get_data_chunks(-(int)buf_fill, buf_fill))
+            buf_c.write(chunk.start, chunk.length);
+        std::vector<int64_t> aa(48), ab(48);
+        while (rounds--) {
+            if (stage == 11) {
+                correlator::correlate_fused_binned_into(buf_a, buf_c, 4*ms, 100*ms, 500*ms, 2*ms,
+                                                        aa.data(), ab.data());
+            } else {
+                correlator::correlate_binned_into(buf_a, buf_a, 4*ms, 100*ms, 500*ms, 2*ms, aa.data());
+                correlator::correlate_binned_into(buf_a, buf_c, 4*ms, 100*ms, 500*ms, 2*ms, ab.data());
+            }
+        }
+        return;
+    }
+
+    if ((stage == 13) || (stage == 14)) {
+        // Stage 2 (13) and stage 11 (14) with lags split between both cores
+        auto &executor = *cor_executor;
+        std::vector<int64_t> out(96*ms), aa(48), ab(48);
+        while (rounds--) {
+            if (stage == 13)
+                correlator::correlate_into(buf_a, buf_a, 4*ms, 100*ms, 500*ms, out.data(),
+                                           executor, correlator::CORRELATE_DIRECT);
+            else
+                correlator::correlate_fused_binned_into(buf_a, buf_a, 4*ms, 100*ms, 500*ms, 2*ms,
+                                                        aa.data(), ab.data(), nullptr, executor);
+        }
+        return;
+    }
+
+    if (stage == 15) {
+        // Stage 2 one lag per call, so every lag takes the per-lag path
+        // instead of the 4-lag block kernel. Compare with stage 2
+        std::vector<int64_t> out(96*ms);
+        while (rounds--)
+            for (unsigned int offset = 4*ms; offset < 100*ms; offset++)
+                correlator::correlate_into(buf_a, buf_a, offset, offset + 1, 500*ms,
+                                           &out[offset - 4*ms], correlator::CORRELATE_DIRECT);
+        return;
+    }
+
+    if (stage > 0) {
+        // correlator_task setup: autocorrelation over 500ms at 4..100ms lags
+        // stage 1 - auto engine, 2 - time domain, 3 - FFT, 4 - sparse
+        int64_t peak{0};
+        correlator::correlate_callback_t f([&](int32_t /*offset*/, int64_t sum) {
+            peak = std::max(peak, sum);
+        });
+        if (stage == 4) {
+            // Only the chirp is above the threshold
+            while (rounds--)
+                correlator::correlate_sparse(buf_a, buf_a, 4*ms, 100*ms, 500*ms, 200, f);
+            return;
+        }
+        auto engine = (stage == 8) ? correlator::CORRELATE_DIRECT :
+                                     static_cast<correlator::correlate_engine_t>(stage - 1);
+        while (rounds--)
+            correlator::correlate(buf_a, buf_a, 4*ms, 100*ms, 500*ms, f, engine);
+        return;
+    }
+
     while (rounds--) {
         auto ret = correlator::correlate_max(buf_a, buf_b, offset_a_min, offset_a_max, buf_b.get_capacity());
         // correlator_offset  = ret.first / ms;
@@ -296,6 +559,7 @@ cli_result_t benchmark_cmd(size_t argc, const char *argv[]) {
     size_t samples_per_round = 128;
     void (* benchmark_func)(size_t n_rounds, int state) = filter_benchmark;
     const char *benchmark_name = "total";
+    UBaseType_t caller_affinity{0};
 
     if (argc >= 1) {
         if (argc > 1) 
@@ -313,8 +577,18 @@ cli_result_t benchmark_cmd(size_t argc, const char *argv[]) {
             benchmark_func = filter_benchmark_fir;
             benchmark_name = "FIR";
         } else
+        if (!strcmp(argv[0], "chain")) {
+            benchmark_func = filter_benchmark_chain;
+            benchmark_name = "chain";
+        } else
         if (!strcmp(argv[0], "cor")) {
             benchmark_func = correlator_benchmark;
+            // Worker tasks are created once, outside of the timed run.
+            // The worker runs on core 1, the caller is kept on core 0 for the run
+            if (!cor_executor)
+                cor_executor = new correlator::TaskExecutor(1, 0x2);
+            caller_affinity = vTaskCoreAffinityGet(NULL);
+            vTaskCoreAffinitySet(NULL, 0x1);
             n_rounds = 1;
             samples_per_round = 1;
             benchmark_name = "COR";
@@ -328,6 +602,8 @@ cli_result_t benchmark_cmd(size_t argc, const char *argv[]) {
     TickType_t start = xTaskGetTickCount();
     benchmark_func(n_rounds, stage);
     TickType_t stop = xTaskGetTickCount();
+    if (caller_affinity)
+        vTaskCoreAffinitySet(NULL, caller_affinity);
 
     size_t time_ms = (stop - start) * portTICK_PERIOD_MS;
 
@@ -99,7 +99,7 @@ cli_result_t results_cmd(size_t argc, const char *argv[]) {
 
         if (xQueueReceive(q, &r, 0) != pdPASS)
             break;
-        cli_debug("source=%d, start=%d, peak=%.1f", r.source, r.offset, r.peak);
+        cli_debug("source=%d, start=%d, peak=%.1f, mode=%d, length=%d", r.source, r.offset, r.peak, r.mode, r.length);
         n++;
     }    
 #endif
@@ -421,7 +421,11 @@ cli_result_t test_cmd(size_t argc, const char *argv[]) {
     cli_info("rx_obj[1] %d", stat->rx_obj[1]);
     cli_info("correlator_in %d", stat->correlator_in);
     cli_info("correlator_runs %d", stat->correlator_runs);
+    cli_info("correlator_scans %d", stat->correlator_scans);
     cli_info("correlator_runtime %d", stat->correlator_runtime);
+    cli_info("correlator_slices %d", stat->correlator_slices);
+    cli_info("correlator_throttled %d", stat->correlator_throttled);
+    cli_info("correlator_restarts %d", stat->correlator_restarts);
 
     return CMD_OK;
 }
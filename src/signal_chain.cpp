@@ -1,3 +1,4 @@
+#include <Arduino.h>
 #include "board_def.h"
 #include <string.h>
 #include <algorithm>
@@ -6,6 +7,7 @@
 #include "filter.h"
 #include "correlator.h"
 #include "detector.h"
+#include "detector_stage.h"
 #include "signal_chain.h"
 
 
@@ -91,8 +93,10 @@ void analog_task(void *pvParameters) {
     auto consumer = std::make_shared<queued_adc::QueuedADCConsumer>();
     data_queue::data_queue_msg_t *data_sink{nullptr};
     size_t data_sink_fill = 0;
+    // Number of round-robin ADC inputs, interleaved in DMA buffers
+    constexpr uint8_t adc_channels{2};
     adc_dma_config_t default_dma_config = {
-        n_inputs: 2,
+        n_inputs: adc_channels,
         inputs: {ADC_CH_S1, ADC_CH_S2}, 
         sample_freq: 500000,
         consumer: consumer
@@ -100,13 +104,16 @@ void analog_task(void *pvParameters) {
     
     // First-stage lowpass filters with passband < 50kHz and decimation = 5
     // Has output rate of 50ksps
-    filter::CICFilter</* M */4, /* R */5> filter_first_a{};
-    filter::CICFilter</* M */4, /* R */5> filter_first_b{};
+    // Both channels are filtered in one pass over the DMA buffer
+    filter::InterleavedCICFilter</* M */4, /* R */5, adc_channels> filter_first{};
+    auto &filter_first_a = filter_first.channel(0);
+    auto &filter_first_b = filter_first.channel(1);
 
     // Second-stage lowpass filters with passband 5kHz and decimation = 3
     // Has output rate of 16ksps
-    filter::FIRFilter filter_second_a(fir_lp_48k_5k, 3);
-    filter::FIRFilter filter_second_b(fir_lp_48k_5k, 3);
+    constexpr size_t fir_decimation{3};
+    filter::FIRFilter filter_second_a(fir_lp_48k_5k, fir_decimation);
+    filter::FIRFilter filter_second_b(fir_lp_48k_5k, fir_decimation);
 
     detector::ObjectDetector det_a(det_threshold, len_threshold);
     detector::ObjectDetector det_b(det_threshold, len_threshold);
@@ -118,7 +125,7 @@ void analog_task(void *pvParameters) {
 
     adc_set_default_dma(&default_dma_config);
 
-    float cic_gain{filter_first_a.gain()};
+    float cic_gain{filter_first.gain()};
 
     while (true) {
         const queued_adc::adc_queue_msg_t *msg;
@@ -151,8 +158,7 @@ void analog_task(void *pvParameters) {
     
         // .. process incoming stage
         stat.filter_in += ADC_BUF_LEN/2;
-        filter_first_a.write(msg->buffer, ADC_BUF_LEN, 2);
-        filter_first_b.write(msg->buffer + 1, ADC_BUF_LEN, 2);
+        filter_first.write(msg->buffer, ADC_BUF_LEN);
 
         // return ADC data buffer
         consumer->return_msg(msg);
@@ -163,39 +169,33 @@ void analog_task(void *pvParameters) {
             data_sink_fill = 0;
         }
 
-        // .. process second stage
+        // .. process second stage, DC removal, detectors and data sink
+        // FIR outputs are passed on to DC block filters and detectors
+        // as they are calculated, see fir_dc_detect()
         // output lengths of _a and _b filters are equal
-        // DC block filter output = input
         size_t first_fill = filter_first_a.out_len();
         if (first_fill >= 16) {
-            filter_second_a.write(filter_first_a.out_buf(), first_fill);
+            // Do not produce more output than the data sink can hold,
+            // the rest stays in the first stage
+            if (data_sink != nullptr)
+                first_fill = std::min(first_fill, (data_queue::DATA_BUF_LEN - data_sink_fill) * fir_decimation);
+
+            size_t fill_a{data_sink_fill};
+            filter_first_a.peek_each(first_fill, [&](const int16_t *data, size_t length) {
+                fill_a += detector::fir_dc_detect(filter_second_a, filter_dc_a, det_a, data, length,
+                                                  data_sink ? data_sink->buffer_a + fill_a : nullptr);
+            });
             filter_first_a.consume(first_fill);
-
-            filter_second_b.write(filter_first_b.out_buf(), first_fill);
+            size_t fill_b{data_sink_fill};
+            filter_first_b.peek_each(first_fill, [&](const int16_t *data, size_t length) {
+                fill_b += detector::fir_dc_detect(filter_second_b, filter_dc_b, det_b, data, length,
+                                                  data_sink ? data_sink->buffer_b + fill_b : nullptr);
+            });
             filter_first_b.consume(first_fill);
-        }
-
-        // process detectors and data sink
-        size_t second_fill{std::min(filter_second_a.out_len(), filter_second_b.out_len())};
-        if (second_fill >= 16) {
-            size_t max_read{data_queue::DATA_BUF_LEN - data_sink_fill};
-            size_t to_read{std::min(second_fill, max_read)};
-
-            // remove dc
-            filter_dc_a.write(filter_second_a.out_buf(), to_read);
-            filter_dc_b.write(filter_second_b.out_buf(), to_read);
-            filter_second_a.consume(to_read);
-            filter_second_b.consume(to_read);
+            const size_t out_len{fill_a - data_sink_fill};
 
-            // fill detectors
-            det_a.write(filter_dc_a.out_buf(), to_read);
-            det_b.write(filter_dc_b.out_buf(), to_read);
-
-            // fill data sink
             if (data_sink != nullptr) {
-                memcpy(data_sink->buffer_a + data_sink_fill, filter_dc_a.out_buf(), to_read*sizeof(data_sink->buffer_a[0]));
-                memcpy(data_sink->buffer_b + data_sink_fill, filter_dc_b.out_buf(), to_read*sizeof(data_sink->buffer_b[0]));
-                data_sink_fill += to_read;
+                data_sink_fill += out_len;
     
                 if (data_sink_fill == data_queue::DATA_BUF_LEN) {
                         // Send message
@@ -206,10 +206,12 @@ void analog_task(void *pvParameters) {
                 }
             }
 
-            // free filter data
-            filter_dc_a.consume(to_read);
-            filter_dc_b.consume(to_read);
-            stat.filter_out += to_read;
+            // Second stage and DC block outputs are only queued for their taps
+            filter_second_a.consume(filter_second_a.out_len());
+            filter_second_b.consume(filter_second_b.out_len());
+            filter_dc_a.consume(filter_dc_a.out_len());
+            filter_dc_b.consume(filter_dc_b.out_len());
+            stat.filter_out += out_len;
         }
 
         // Save detected objects
@@ -239,14 +241,60 @@ void correlator_task(void *pvParameters) {
     constexpr unsigned int processing_interval{1000*ms};
     constexpr unsigned int offset_a_min{4*ms};
     constexpr unsigned int offset_a_max{100*ms};
-    constexpr unsigned int correlation_len{500*ms};
-    constexpr unsigned int buf_size{offset_a_max+correlation_len};
+    // A->B lags start at 0, time of flight between the channels may be short
+    constexpr unsigned int offset_ab_min{0};
+    // Correlation window is sized by the activity: it holds about target_objects
+    // detected objects and target_blocks active blocks of the buffer
+    constexpr unsigned int min_correlation_len{200*ms};
+    constexpr unsigned int max_correlation_len{700*ms};
+    constexpr unsigned int target_objects{8};
+    constexpr unsigned int target_blocks{64};
+    // Runs are at least run_interval windows apart
+    constexpr unsigned int run_interval{3};
+    // Buffers keep the needle of a running correlation job for job_margin samples
+    constexpr unsigned int job_margin{200*ms};
+    constexpr unsigned int buf_size{offset_a_max+max_correlation_len+job_margin};
     correlator::CircularBuffer buf(buf_size);
+    // Channel B is kept in lockstep with `buf` for the fused A->B correlation
+    correlator::CircularBuffer buf_b(buf_size);
     
     detector::ObjectDetector det(det_threshold, len_threshold);
     size_t data_cnt{0};
-    constexpr size_t min_data_cnt{1500*ms};
+    size_t min_data_cnt{run_interval*max_correlation_len};
     detector::detected_object_t last_object_b{};
+    std::deque<uint64_t> object_starts; // objects detected within the buffer
+
+    // Once the peak is locked, only bins around it are correlated;
+    // full range is scanned again on schedule or when the peak is lost
+    constexpr size_t track_bins{2};             // bins on each side of the locked peak
+    constexpr unsigned int rescan_interval{16}; // runs between full scans
+    bool locked{false};
+    size_t locked_bin{0};
+    int64_t locked_peak{0};
+    unsigned int runs_since_scan{0};
+
+    // Correlation runs as a job computed in slices between received buffers,
+    // so that it may share a core with analog_task
+    constexpr size_t bin_step{2*ms};
+    constexpr size_t num_bins{(offset_a_max - offset_a_min)/bin_step};
+    constexpr size_t slice_bins{4};             // bins computed per received buffer
+    constexpr uint32_t cpu_budget_us{300000};   // correlator CPU time per second
+    correlator::CorrelationJob job(buf, buf, bin_step);
+    auto job_mode{CORRELATOR_MODE_SCAN};
+    size_t job_first{0};                        // first bin of the job
+    uint32_t job_cpu_us{0};
+    uint32_t job_len{0};
+    uint32_t budget_start{micros()};
+    uint32_t budget_used_us{0};
+
+    // Full scans get A->B correlation in the same pass over the data
+    auto start_job = [&](correlator_mode_t mode, size_t first, size_t last) {
+        job_mode = mode;
+        job_first = first;
+        job_cpu_us = 0;
+        job.start(offset_a_min + first * bin_step, offset_a_min + last * bin_step, job_len,
+                  (mode == CORRELATOR_MODE_SCAN) ? &buf_b : nullptr, offset_ab_min);
+    };
 
     while (true) {
         // receive ADC data buffer
@@ -255,6 +303,8 @@ void correlator_task(void *pvParameters) {
         constexpr auto rx_len{data_queue::DATA_BUF_LEN};
         // save data to circular buffers
         buf.write(msg->buffer_a, rx_len);
+        buf_b.write(msg->buffer_b, rx_len);
+        job.advance(rx_len);
         // write data to object detector
         det.write(msg->buffer_a, rx_len);
         sample_queue->receive_msg_return(msg);
@@ -264,15 +314,12 @@ void correlator_task(void *pvParameters) {
         if (circ_buf_tap->is_triggered()) {
             circular_buf_tap_t tap;
             tap.source = 0;
-            int size = buf.get_capacity();
-            auto data =  buf.get_data();
-            int pos = buf.get_data_ptr();
-            for (int n = 0; n < buf.get_capacity(); n += ms) {
+            const int size = buf.get_capacity();
+            const correlator::CircularBufferView view(buf, -size, size);
+            for (int n = 0; n < size; n += ms) {
                 tap.index = n;
-                for (int m = 0; m < ms; m++) {
-                    int idx = (pos + n + m) % size;
-                    tap.data[m] = data[idx];
-                }
+                for (int m = 0; m < ms; m++)
+                    tap.data[m] = view[n + m];
                 circ_buf_tap->send(tap);
             }
             circ_buf_tap->complete();
@@ -280,62 +327,119 @@ void correlator_task(void *pvParameters) {
 
         if (det.results.size() > 0) {
             last_object_b = det.results.front();
+            for (const auto &obj: det.results)
+                object_starts.push_back(obj.start);
             det.results.clear();
         }
+        while (!object_starts.empty() &&
+               (det.get_timestamp() - object_starts.front() > buf.get_capacity()))
+            object_starts.pop_front();
 
         bool run_correlator = (data_cnt > min_data_cnt) &&
             (last_object_b.start != 0) &&
             ((det.get_timestamp() - last_object_b.start) < buf.get_capacity());
         last_object_b = {};
         
-        // Run correlator
-        if (run_correlator) {
+        // Start correlator, triggers are dropped while a job is running
+        if (run_correlator && !job.is_active()) {
             stat.correlator_runs++;
             data_cnt = 0;
 
-            TickType_t start = xTaskGetTickCount();
-
-            //int32_t max_index{0};
-            //int64_t max_val{0};
-            constexpr size_t bin_step{2*ms};
-            constexpr size_t num_bins{(offset_a_max - offset_a_min)/bin_step};
-            std::array<int64_t, num_bins> bins{};
-
-            correlator::correlate_callback_t f([&](int32_t offset, int64_t sum) {
-                const auto bin_no = (offset - offset_a_min)/bin_step;
-                bins[bin_no] += sum;
-                // if (sum > max_val) {
-                //     max_val = sum;
-                //     max_index = bin_no;
-                // }
-            }); 
-
-            // run autocorrelation
-            correlator::correlate(buf, buf, offset_a_min, offset_a_max, correlation_len, f);
-
-            TickType_t stop = xTaskGetTickCount();
-            stat.correlator_runtime = (stop - start) * portTICK_PERIOD_MS; // ms
+            // Window reaching back to the target_objects-th latest object,
+            // extended if the buffer has little energy in it
+            uint32_t objects_len{max_correlation_len};
+            if (object_starts.size() >= target_objects)
+                objects_len = det.get_timestamp() - object_starts[object_starts.size() - target_objects];
+            const uint32_t energy_len = correlator::active_window_length(buf, min_correlation_len,
+                                                        max_correlation_len, det_threshold, target_blocks);
+            job_len = std::min(std::max({objects_len, energy_len, min_correlation_len}), max_correlation_len);
+            min_data_cnt = run_interval * job_len;
+
+            if (locked && (runs_since_scan < rescan_interval)) {
+                const size_t first = (locked_bin > track_bins) ? locked_bin - track_bins : 0;
+                const size_t last = std::min(locked_bin + track_bins + 1, num_bins);
+                start_job(CORRELATOR_MODE_TRACK, first, last);
+            } else {
+                start_job(CORRELATOR_MODE_SCAN, 0, num_bins);
+            }
+        }
 
-            const auto max_it = std::max_element(bins.cbegin(), bins.cend());
-            const auto max_index = max_it - bins.cbegin();
-            const auto max_offset = (max_index * bin_step) / ms;
+        if (!job.is_active())
+            continue;
 
-            correlator_result_t res;
-            res.source = 0;
-            res.offset = max_offset; // (offset_a_min + max_index * bin_step) / ms;
-            res.peak = *max_it; // max_val;
+        // Run a slice of the job if the budget of the current second allows
+        const uint32_t slice_start = micros();
+        if (slice_start - budget_start >= 1000000) {
+            budget_start = slice_start;
+            budget_used_us = 0;
+        }
+        if (budget_used_us >= cpu_budget_us) {
+            stat.correlator_throttled++;
+            continue;
+        }
+        const bool done = job.step(slice_bins);
+        const uint32_t slice_us = micros() - slice_start;
+        budget_used_us += slice_us;
+        job_cpu_us += slice_us;
+        stat.correlator_slices++;
+        stat.correlator_restarts = job.get_restarts();
+        if (!done)
+            continue;
+        job.finish();
+
+        std::array<int64_t, num_bins> bins{};
+        const size_t first = job_first;
+        const size_t last = job_first + job.get_n_bins();
+        std::copy(job.get_bins(), job.get_bins() + job.get_n_bins(), bins.begin() + first);
+        const size_t max_index = std::max_element(bins.cbegin() + first, bins.cbegin() + last) - bins.cbegin();
+
+        if (job_mode == CORRELATOR_MODE_TRACK) {
+            // Peak at the window edge may be outside of it, a weak one may be noise
+            const bool at_edge = ((max_index == first) && (first > 0)) ||
+                                 ((max_index == last - 1) && (last < num_bins));
+            if (at_edge || (bins[max_index] < locked_peak / 2)) {
+                start_job(CORRELATOR_MODE_SCAN, 0, num_bins);
+                continue;
+            }
+            runs_since_scan++;
+        } else {
+            stat.correlator_scans++;
+            runs_since_scan = 0;
+            locked_peak = bins[max_index];
+            locked = locked_peak > 0;
+        }
+        locked_bin = max_index;
+
+        stat.correlator_runtime = job_cpu_us / 1000; // ms of CPU time over all slices
+
+        const auto max_it = bins.cbegin() + max_index;
+
+        correlator_result_t res{};
+        res.source = 0;
+        res.offset = (offset_a_min + max_index * bin_step) / ms;
+        res.peak = *max_it; // max_val;
+        res.mode = job_mode;
+        res.length = job_len / ms;
+        xQueueSendToBack(correlator_results_q, &res, 0);
+
+        if (job_mode == CORRELATOR_MODE_SCAN) {
+            const int64_t *bins_ab = job.get_bins_b2();
+            const auto max_ab = std::max_element(bins_ab, bins_ab + job.get_n_bins_b2());
+            res.source = 2;
+            res.offset = (job.get_b2_offset_min() + (max_ab - bins_ab) * bin_step) / ms;
+            res.peak = *max_ab;
             xQueueSendToBack(correlator_results_q, &res, 0);
+        }
 
-            if (correlator_tap->is_triggered()) {
-                correlator_tap_t tap;
-                for (size_t m = 0; m < num_bins; m++) {
-                    tap.index = (offset_a_min + max_index * bin_step) / ms;
-                    tap.peak = (float)bins[m];
-                    correlator_tap->send(tap);
-                }
-                correlator_tap->complete();
+        if (correlator_tap->is_triggered()) {
+            correlator_tap_t tap;
+            for (size_t m = 0; m < num_bins; m++) {
+                tap.index = (offset_a_min + max_index * bin_step) / ms;
+                tap.peak = (float)bins[m];
+                correlator_tap->send(tap);
             }
-        }       
+            correlator_tap->complete();
+        }
     }
 }
 
@@ -406,10 +510,11 @@ void detector_task(void *pvParameters) {
             const auto max_index = max_it - bins.cbegin();
             const auto max_offset = (max_index * bin_step) / ms;
 
-            correlator_result_t res;
+            correlator_result_t res{};
             res.source = 1;
             res.offset = max_offset;
             res.peak = n_cycles; //*max_it;
+            res.mode = CORRELATOR_MODE_SCAN;
             xQueueSendToBack(correlator_results_q, &res, 0);
         }
     }
@@ -3,10 +3,19 @@
 
 #include "analog.h"
 
+typedef enum {
+    // Full offset range was correlated
+    CORRELATOR_MODE_SCAN  = 0,
+    // Only bins around the last locked peak were correlated
+    CORRELATOR_MODE_TRACK = 1
+} correlator_mode_t;
+
 typedef struct {
-    int source;
+    int source; // 0: A autocorrelation, 1: detected objects, 2: A->B correlation
     int offset;
     float peak;
+    correlator_mode_t mode;
+    int length; // correlation window, ms; 0 for detected objects
 } correlator_result_t;
 
 typedef struct {
@@ -27,7 +36,11 @@ typedef struct {
     uint32_t detector_out;
     uint32_t correlator_in;
     uint32_t correlator_runs;
+    uint32_t correlator_scans;
     uint32_t correlator_runtime;
+    uint32_t correlator_slices;
+    uint32_t correlator_throttled;  // slices postponed by the CPU budget
+    uint32_t correlator_restarts;   // jobs restarted as their data was overwritten
     uint32_t rx_obj[2];
 } signal_chain_stat_t;
 
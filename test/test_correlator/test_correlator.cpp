@@ -2,6 +2,9 @@
 #include <string.h>
 #include <stdio.h>
 #include "correlator.h"
+#include "binary.h"
+#include "compact.h"
+#include "executor.h"
 
 using namespace correlator;
 
@@ -65,6 +68,54 @@ void test_circular_buffer_chunks() {
     TEST_ASSERT_EQUAL_INT(0, ret.size());
 }
 
+void test_circular_buffer_wrap() {
+    CircularBuffer cbuf(128);
+    CircularBuffer ref(128);
+    int16_t data[200];
+    for (int n = 0; n < 200; n++)
+        data[n] = n;
+
+    // Written in pieces of 50, wrapping
+    for (size_t written = 0; written < 200; written += 50)
+        cbuf.write(data + written, 50);
+    ref.write(data, 100);
+    ref.write(data + 100, 100);
+    TEST_ASSERT_EQUAL(ref.get_data_ptr(), cbuf.get_data_ptr());
+    TEST_ASSERT_EQUAL_INT16_ARRAY(ref.get_data(), cbuf.get_data(), 128);
+    TEST_ASSERT_EQUAL(199, cbuf.get_max(-1, 1));
+
+    // Write position wraps to 0 at the buffer end
+    cbuf.write(data, 56);
+    TEST_ASSERT_EQUAL(0, cbuf.get_data_ptr());
+
+    // Mirrored copy is updated
+    CircularBuffer mbuf(128, true);
+    mbuf.write(data + 1, 10);
+    TEST_ASSERT_EQUAL_INT(10, mbuf.get_data()[128 + 9]);
+}
+
+void test_circular_buffer_view() {
+    CircularBuffer cbuf(128);
+    int16_t data[200];
+    for (int n = 0; n < 200; n++)
+        data[n] = n;
+    cbuf.write(data, 100);
+    cbuf.write(data + 100, 100);
+
+    CircularBufferView view(cbuf, -100, 90);
+    TEST_ASSERT_EQUAL_INT(90, view.size());
+    TEST_ASSERT_EQUAL_INT(2, view.get_n_chunks());
+    for (size_t n = 0; n < view.size(); n++)
+        TEST_ASSERT_EQUAL_INT(100 + n, view[n]);
+
+    // Later writes do not move the view
+    cbuf.write(data, 10);
+    TEST_ASSERT_EQUAL_INT(100, view[0]);
+    TEST_ASSERT_EQUAL_INT(189, view[89]);
+
+    TEST_ASSERT_EQUAL_INT(0, CircularBufferView(cbuf, -129, 10).size());
+}
+
 void test_break_chunks() {
     CircularBuffer a(64);
     CircularBuffer b(16);
@@ -173,13 +224,902 @@ void test_correlator() {
 
 }
 
+// Fills buffer with DC-free noise and sparse pulses, similar to filtered sensor data
+static void fill_pulses(CircularBuffer &buf, size_t length, int noise, int ampl) {
+    std::vector<int16_t> data(length);
+    for (size_t n = 0; n < length; n++)
+        data[n] = rand() % (2*noise + 1) - noise;
+    for (size_t n = 40; n + 8 < length; n += 97 + rand() % 300)
+        for (size_t m = 0; m < 8; m++)
+            data[n + m] += ampl - (m % 4) * (ampl / 4);
+    buf.write(data.data(), length);
+}
+
+static std::vector<int64_t> correlate_vec(const CircularBuffer &a, const CircularBuffer &b,
+                                          uint32_t min, uint32_t max, uint32_t length,
+                                          correlate_engine_t engine) {
+    std::vector<int64_t> ret(max - min);
+    correlator::correlate_callback_t f{[&](int32_t offset, int64_t val) {
+        ret[offset - min] = val;
+    }};
+    correlate(a, b, min, max, length, f, engine);
+    return ret;
+}
+
+void test_correlator_engine_select() {
+    // correlator_task configuration at 16ksps
+    TEST_ASSERT_EQUAL(CORRELATE_FFT, correlate_select_engine(96*16, 500*16));
+    // Few lags are cheaper in time domain
+    TEST_ASSERT_EQUAL(CORRELATE_DIRECT, correlate_select_engine(40, 16));
+    TEST_ASSERT_EQUAL(CORRELATE_DIRECT, correlate_select_engine(4, 8000));
+    // Lag range larger than largest FFT
+    TEST_ASSERT_EQUAL(CORRELATE_DIRECT, correlate_select_engine(4000, 8000));
+    TEST_ASSERT_EQUAL(CORRELATE_DIRECT, correlate_select_engine(0, 8000));
+}
+
+void test_correlator_fft() {
+    const uint32_t min = 13, max = 413, length = 2500;
+    CircularBuffer a(3200);
+    CircularBuffer b(2600);
+
+    srand(1);
+    // Write with wrap so that chunks are split
+    fill_pulses(a, 1000, 40, 2000);
+    fill_pulses(a, 3000, 40, 2000);
+    fill_pulses(b, 2000, 40, 1500);
+    fill_pulses(b, 2000, 40, 1500);
+
+    auto direct = correlate_vec(a, b, min, max, length, CORRELATE_DIRECT);
+    auto fft = correlate_vec(a, b, min, max, length, CORRELATE_FFT);
+
+    int64_t peak{0};
+    for (auto v: direct)
+        peak = std::max<int64_t>(peak, llabs(v));
+
+    int64_t max_err{0};
+    for (size_t n = 0; n < direct.size(); n++)
+        max_err = std::max<int64_t>(max_err, llabs(direct[n] - fft[n]));
+
+    char buf[128];
+    sprintf(buf, "peak %lld, max error %lld", (long long)peak, (long long)max_err);
+    TEST_MESSAGE(buf);
+    TEST_ASSERT_TRUE(peak > 0);
+    TEST_ASSERT_TRUE(max_err <= peak / 512);
+
+    // Autocorrelation of the same buffer, as in correlator_task
+    direct = correlate_vec(a, a, 64, 1600, 1500, CORRELATE_DIRECT);
+    fft = correlate_vec(a, a, 64, 1600, 1500, CORRELATE_AUTO);
+    peak = 0;
+    max_err = 0;
+    for (size_t n = 0; n < direct.size(); n++) {
+        peak = std::max<int64_t>(peak, llabs(direct[n]));
+        max_err = std::max<int64_t>(max_err, llabs(direct[n] - fft[n]));
+    }
+    sprintf(buf, "peak %lld, max error %lld", (long long)peak, (long long)max_err);
+    TEST_MESSAGE(buf);
+    TEST_ASSERT_TRUE(max_err <= peak / 512);
+}
+
+void test_correlator_fft_no_data() {
+    CircularBuffer a(1000);
+    CircularBuffer b(1000);
+    correlator::correlate_callback_t f{[&](int32_t /*offset*/, int64_t /*val*/) {}};
+
+    // Haystack is too short for the largest lag
+    TEST_ASSERT_FALSE(correlate_fft(a, b, 100, 600, 500, f));
+    TEST_ASSERT_TRUE(correlate_fft(a, b, 100, 500, 500, f));
+}
+
+// Reference correlation over linearised buffer contents, 0 for offsets without data
+static int64_t correlate_naive(const CircularBuffer &a, const CircularBuffer &b,
+                               uint32_t offset, uint32_t length) {
+    if (length + offset > a.get_capacity())
+        return 0;
+    auto at = [](const CircularBuffer &buf, int pos) {
+        int idx = (int)buf.get_data_ptr() + pos;
+        while (idx < 0)
+            idx += buf.get_capacity();
+        return (int64_t)buf.get_data()[idx % buf.get_capacity()];
+    };
+    int64_t sum{0};
+    for (int n = 0; n < (int)length; n++)
+        sum += at(a, n - (int)length - (int)offset) * at(b, n - (int)length);
+    return sum;
+}
+
+void test_correlator_lag_block() {
+    CircularBuffer a(500);
+    CircularBuffer b(300);
+
+    srand(4);
+    fill_pulses(a, 730, 40, 2000);
+    fill_pulses(b, 410, 40, 2000);
+
+    // Offset counts which are not multiple of the block, chunks split at
+    // different places for different offsets, offsets out of data
+    const uint32_t ranges[][3] = {
+        {0, 4, 200}, {3, 66, 250}, {100, 111, 300}, {195, 230, 290}, {1, 2, 17}
+    };
+    for (const auto &r: ranges) {
+        auto direct = correlate_vec(a, b, r[0], r[1], r[2], CORRELATE_DIRECT);
+        for (uint32_t offset = r[0]; offset < r[1]; offset++)
+            TEST_ASSERT_EQUAL_INT64(correlate_naive(a, b, offset, r[2]), direct[offset - r[0]]);
+    }
+}
+
+void test_sliding_correlator() {
+    const uint32_t min = 5, max = 60, length = 200;
+    constexpr size_t block_len = 16;
+    CircularBuffer a(300);
+    CircularBuffer b(300);
+    SlidingCorrelator sliding(a, b, min, max, length);
+    int16_t data_a[block_len];
+    int16_t data_b[block_len];
+
+    srand(2);
+    for (size_t block = 0; block < 50; block++) {
+        for (size_t n = 0; n < block_len; n++) {
+            data_a[n] = rand() % 2001 - 1000;
+            data_b[n] = rand() % 2001 - 1000;
+        }
+        a.write(data_a, block_len);
+        b.write(data_b, block_len);
+        sliding.update(block_len);
+
+        TEST_ASSERT_EQUAL((block + 1) * block_len >= length, sliding.is_full());
+        // Sums shall be exact from the start, as buffers are zeroed
+        auto direct = correlate_vec(a, b, min, max, length, CORRELATE_DIRECT);
+        for (uint32_t offset = min; offset < max; offset++)
+            TEST_ASSERT_EQUAL_INT64(direct[offset - min], sliding.get(offset));
+    }
+
+    // Update that would overwrite leaving samples is recalculated
+    int16_t data[64];
+    for (size_t n = 0; n < 64; n++)
+        data[n] = rand() % 2001 - 1000;
+    a.write(data, 64);
+    b.write(data, 64);
+    sliding.update(64);
+    auto direct = correlate_vec(a, b, min, max, length, CORRELATE_DIRECT);
+    for (uint32_t offset = min; offset < max; offset++)
+        TEST_ASSERT_EQUAL_INT64(direct[offset - min], sliding.get(offset));
+}
+
+static void check_binned(const CircularBuffer &a, const CircularBuffer &b,
+                         uint32_t min, uint32_t max, uint32_t length, uint32_t bin_step) {
+    auto direct = correlate_vec(a, b, min, max, length, CORRELATE_DIRECT);
+    size_t n_bins{0};
+
+    correlator::correlate_callback_t f{[&](int32_t offset, int64_t val) {
+        TEST_ASSERT_EQUAL_INT(min + n_bins * bin_step, offset);
+        int64_t expected{0};
+        for (uint32_t n = offset; n < std::min(offset + bin_step, max); n++)
+            expected += direct[n - min];
+        TEST_ASSERT_EQUAL_INT64(expected, val);
+        n_bins++;
+    }};
+    correlate_binned(a, b, min, max, length, bin_step, f);
+    TEST_ASSERT_EQUAL_INT((max - min + bin_step - 1) / bin_step, n_bins);
+}
+
+void test_correlator_binned() {
+    CircularBuffer a(1000);
+    CircularBuffer b(700);
+
+    srand(3);
+    fill_pulses(a, 1700, 40, 2000);
+    fill_pulses(b, 900, 40, 2000);
+
+    // Whole bins
+    check_binned(a, b, 10, 330, 500, 32);
+    // Partial last bin
+    check_binned(a, b, 7, 300, 600, 16);
+    check_binned(a, b, 0, 3, 600, 16);
+    // Autocorrelation, as in correlator_task
+    check_binned(a, a, 64, 320, 640, 32);
+    // Haystack is too short for some offsets
+    check_binned(a, b, 300, 500, 600, 32);
+}
+
+void test_circular_buffer_summary() {
+    CircularBuffer cbuf(40);
+    int16_t data[64]{};
+
+    data[5] = -300;
+    data[20] = 100;
+    cbuf.write(data, 24);
+    TEST_ASSERT_EQUAL(300, cbuf.get_max(-24, 24));
+    TEST_ASSERT_EQUAL(100, cbuf.get_max(-8, 8));
+    // Region within a block gets the whole block bound
+    TEST_ASSERT_EQUAL(300, cbuf.get_max(-24, 2));
+
+    // Write with wrap, last block is partial
+    data[5] = 0;
+    data[20] = 0;
+    data[30] = 7;
+    cbuf.write(data, 32);
+    TEST_ASSERT_EQUAL(100, cbuf.get_max(-40, 40));
+    TEST_ASSERT_EQUAL(7, cbuf.get_max(-16, 16));
+    TEST_ASSERT_EQUAL(0, cbuf.get_max(-24, 8));
+}
+
+void test_active_window_length() {
+    CircularBuffer buf(1024);
+    std::vector<int16_t> zeros(1024, 0);
+    std::vector<int16_t> pulse(16, -300);
+    buf.write(zeros.data(), zeros.size());
+
+    // Active blocks end 32, 112 and 192 samples back
+    buf.write(pulse.data(), pulse.size());
+    buf.write(zeros.data(), 64);
+    buf.write(pulse.data(), pulse.size());
+    buf.write(zeros.data(), 64);
+    buf.write(pulse.data(), pulse.size());
+    buf.write(zeros.data(), 32);
+
+    TEST_ASSERT_EQUAL(48, active_window_length(buf, 16, 600, 300, 1));
+    TEST_ASSERT_EQUAL(128, active_window_length(buf, 16, 600, 300, 2));
+    TEST_ASSERT_EQUAL(208, active_window_length(buf, 16, 600, 300, 3));
+    // Not enough activity
+    TEST_ASSERT_EQUAL(600, active_window_length(buf, 16, 600, 300, 4));
+    TEST_ASSERT_EQUAL(600, active_window_length(buf, 16, 600, 301, 1));
+    // Limits
+    TEST_ASSERT_EQUAL(100, active_window_length(buf, 100, 600, 300, 1));
+    TEST_ASSERT_EQUAL(1024, active_window_length(buf, 100, 5000, 300, 4));
+    TEST_ASSERT_EQUAL(40, active_window_length(buf, 16, 40, 300, 2));
+}
+
+void test_correlator_sparse() {
+    CircularBuffer a(1000);
+    CircularBuffer b(700);
+    correlator::correlate_callback_t f{[](int32_t, int64_t) {}};
+
+    srand(5);
+    fill_pulses(a, 1700, 40, 2000);
+    fill_pulses(b, 900, 40, 2000);
+
+    // Zero threshold skips nothing
+    // Last range has lag blocks crossing the capacity of a
+    const uint32_t ranges[][3] = {{3, 66, 500}, {10, 331, 600}, {280, 420, 600}, {397, 405, 600}};
+    for (const auto &r: ranges) {
+        std::vector<int64_t> sparse(r[1] - r[0]);
+        correlator::correlate_callback_t f{[&](int32_t offset, int64_t val) {
+            sparse[offset - r[0]] = val;
+        }};
+        TEST_ASSERT_EQUAL_INT64(0, correlate_sparse(a, b, r[0], r[1], r[2], 0, f));
+        for (uint32_t offset = r[0]; offset < r[1]; offset++)
+            TEST_ASSERT_EQUAL_INT64(correlate_naive(a, b, offset, r[2]), sparse[offset - r[0]]);
+    }
+
+    // Noise is below the threshold, errors stay within the returned bound
+    for (const auto &r: ranges) {
+        std::vector<int64_t> sparse(r[1] - r[0]);
+        correlator::correlate_callback_t f{[&](int32_t offset, int64_t val) {
+            sparse[offset - r[0]] = val;
+        }};
+        const int64_t bound = correlate_sparse(a, b, r[0], r[1], r[2], 100, f);
+        int64_t max_err{0};
+        for (uint32_t offset = r[0]; offset < r[1]; offset++) {
+            const int64_t err = llabs(correlate_naive(a, b, offset, r[2]) - sparse[offset - r[0]]);
+            max_err = std::max(max_err, err);
+        }
+        char buf[128];
+        sprintf(buf, "max error %lld, bound %lld", (long long)max_err, (long long)bound);
+        TEST_MESSAGE(buf);
+        TEST_ASSERT_TRUE(bound > 0);
+        TEST_ASSERT_TRUE(max_err <= bound);
+    }
+
+    // Silent needle
+    CircularBuffer c(700);
+    TEST_ASSERT_EQUAL_INT64(0, correlate_sparse(a, c, 10, 100, 500, 100, f));
+
+    // Haystack spans of a lag block partially past the capacity
+    CircularBuffer d(1000);
+    CircularBuffer e(700);
+    std::vector<int16_t> ones(1000, 1000);
+    std::vector<int16_t> pulse(600, 0);
+    for (size_t n = 0; n < 16; n++)
+        pulse[n] = 500;
+    d.write(ones.data(), ones.size());
+    e.write(pulse.data(), pulse.size());
+    std::vector<int64_t> sparse(4);
+    correlator::correlate_callback_t g{[&](int32_t offset, int64_t val) {
+        sparse[offset - 400] = val;
+    }};
+    TEST_ASSERT_EQUAL_INT64(0, correlate_sparse(d, e, 400, 404, 600, 100, g));
+    TEST_ASSERT_EQUAL_INT64(8000000, sparse[0]);
+    for (size_t k = 1; k < 4; k++)
+        TEST_ASSERT_EQUAL_INT64(0, sparse[k]);
+}
+
+void test_correlator_max_exact() {
+    // Lag range for which CORRELATE_AUTO picks the approximate FFT
+    const uint32_t min = 64, max = 1600, length = 1500;
+    TEST_ASSERT_EQUAL(CORRELATE_FFT, correlate_select_engine(max - min, length));
+
+    CircularBuffer a(3200);
+    CircularBuffer b(2600);
+    srand(9);
+    fill_pulses(a, 3200, 40, 2000);
+    fill_pulses(b, 2600, 40, 2000);
+
+    auto direct = correlate_vec(a, b, min, max, length, CORRELATE_DIRECT);
+    std::pair<int32_t, int64_t> ref{0, 0};
+    for (uint32_t offset = min; offset < max; offset++)
+        if (direct[offset - min] > ref.second)
+            ref = {offset, direct[offset - min]};
+
+    auto ret = correlate_max(a, b, min, max, length);
+    TEST_ASSERT_TRUE(ref.second > 0);
+    TEST_ASSERT_EQUAL_INT(ref.first, ret.first);
+    TEST_ASSERT_EQUAL_INT64(ref.second, ret.second);
+}
+
+// Reference peak: smallest offset of the largest positive value, (0, 0) if none
+static std::pair<int32_t, int64_t> max_naive(const CircularBuffer &a, const CircularBuffer &b,
+                                             uint32_t min, uint32_t max, uint32_t length) {
+    std::pair<int32_t, int64_t> ret{0, 0};
+    for (uint32_t offset = min; offset < max; offset++) {
+        int64_t v = correlate_naive(a, b, offset, length);
+        if (v > ret.second)
+            ret = {offset, v};
+    }
+    return ret;
+}
+
+void test_correlator_max_bounded() {
+    CircularBuffer a(1000);
+    CircularBuffer b(700);
+
+    srand(6);
+    fill_pulses(a, 1700, 40, 2000);
+    fill_pulses(b, 900, 40, 2000);
+
+    const uint32_t ranges[][3] = {{3, 66, 500}, {10, 331, 600}, {280, 420, 600}, {0, 5, 7}};
+    for (const auto &r: ranges) {
+        auto ref = max_naive(a, b, r[0], r[1], r[2]);
+        // Hints at the peak, inside the range, and outside of it
+        for (int32_t hint: {ref.first, (int32_t)(r[0] + r[1]) / 2, -1, (int32_t)r[1]}) {
+            auto ret = correlate_max_bounded(a, b, r[0], r[1], r[2], hint);
+            TEST_ASSERT_EQUAL_INT(ref.first, ret.first);
+            TEST_ASSERT_EQUAL_INT64(ref.second, ret.second);
+        }
+    }
+
+    // Lag range for which CORRELATE_AUTO would pick the FFT, both searches are exact
+    CircularBuffer big_a(3200);
+    CircularBuffer big_b(2600);
+    fill_pulses(big_a, 3200, 40, 2000);
+    fill_pulses(big_b, 2600, 40, 2000);
+    TEST_ASSERT_EQUAL(CORRELATE_FFT, correlate_select_engine(1600 - 64, 1500));
+    auto direct = correlate_vec(big_a, big_b, 64, 1600, 1500, CORRELATE_DIRECT);
+    const auto peak = std::max_element(direct.begin(), direct.end());
+    auto max = correlate_max(big_a, big_b, 64, 1600, 1500);
+    auto bounded = correlate_max_bounded(big_a, big_b, 64, 1600, 1500, 800);
+    TEST_ASSERT_EQUAL_INT(64 + (peak - direct.begin()), max.first);
+    TEST_ASSERT_EQUAL_INT64(*peak, max.second);
+    TEST_ASSERT_EQUAL_INT(max.first, bounded.first);
+    TEST_ASSERT_EQUAL_INT64(max.second, bounded.second);
+
+    // Ties resolve to the smallest offset, as in correlate_max()
+    CircularBuffer c(300);
+    int16_t data[300]{};
+    for (size_t n = 0; n < 300; n += 50)
+        data[n] = 100;
+    c.write(data, 300);
+    auto ret = correlate_max_bounded(c, c, 1, 200, 100, 150);
+    TEST_ASSERT_EQUAL_INT(50, ret.first);
+    TEST_ASSERT_EQUAL_INT64(20000, ret.second);
+
+    // No positive values
+    CircularBuffer z(300);
+    ret = correlate_max_bounded(z, z, 1, 200, 100, 20);
+    TEST_ASSERT_EQUAL_INT(0, ret.first);
+    TEST_ASSERT_EQUAL_INT64(0, ret.second);
+}
+
+// Returns noise and DC-free pulses, plus their echo `delay` samples later
+static std::vector<int16_t> make_echo(size_t length, uint32_t delay) {
+    std::vector<int16_t> s(length);
+    std::vector<int16_t> data(length);
+    for (size_t n = 0; n < length; n++)
+        s[n] = rand() % 41 - 20;
+    for (size_t n = 30; n + 32 < length; n += 100 + rand() % 300)
+        for (int m = 0; m < 32; m++)
+            s[n + m] += ((m < 16) ? 1 : -1) * (900 - abs(m % 16 - 8) * 100);
+    for (size_t n = 0; n < length; n++)
+        data[n] = s[n] + ((n >= delay) ? s[n - delay] : 0);
+    return data;
+}
+
+void test_correlator_coarse_fine() {
+    CircularBuffer a(3200);
+    CircularBuffer b(1000);
+
+    srand(7);
+    auto data = make_echo(3500, 537);
+    a.write(data.data(), data.size());
+    // Needle is the haystack 300 samples back
+    b.write(data.data(), data.size() - 300);
+
+    // Autocorrelation, as in correlator_task
+    auto ref = max_naive(a, a, 64, 1600, 1500);
+    TEST_ASSERT_INT_WITHIN(4, 537, ref.first);
+    for (uint32_t decimation: {1, 2, 4, 8}) {
+        auto ret = correlate_coarse_fine(a, a, 64, 1600, 1500, decimation);
+        TEST_ASSERT_EQUAL_INT(ref.first, ret.offset);
+        TEST_ASSERT_EQUAL_INT64(ref.second, ret.peak);
+        TEST_ASSERT_FLOAT_WITHIN(0.5f, (float)ret.offset, ret.delay);
+    }
+
+    // Offset range not a multiple of decimation
+    ref = max_naive(a, b, 3, 901, 700);
+    TEST_ASSERT_EQUAL_INT(300, ref.first);
+    auto ret = correlate_coarse_fine(a, b, 3, 901, 700);
+    TEST_ASSERT_EQUAL_INT(ref.first, ret.offset);
+    TEST_ASSERT_EQUAL_INT64(ref.second, ret.peak);
+    TEST_ASSERT_FLOAT_WITHIN(0.1f, 300.0f, ret.delay);
+
+    // No positive values
+    CircularBuffer z(1000);
+    ret = correlate_coarse_fine(z, z, 10, 200, 500);
+    TEST_ASSERT_EQUAL_INT64(0, ret.peak);
+    TEST_ASSERT_EQUAL_INT(0, ret.offset);
+}
+
+void test_correlator_into() {
+    CircularBuffer a(1000);
+    CircularBuffer b(700);
+
+    srand(8);
+    fill_pulses(a, 1700, 40, 2000);
+    fill_pulses(b, 900, 40, 2000);
+
+    for (auto engine: {CORRELATE_DIRECT, CORRELATE_FFT}) {
+        // Offset count not a multiple of the output block
+        auto ref = correlate_vec(a, b, 5, 290, 600, engine);
+        std::vector<int64_t> out(ref.size());
+        correlate_into(a, b, 5, 290, 600, out.data(), engine);
+        TEST_ASSERT_EQUAL_INT64_ARRAY(ref.data(), out.data(), ref.size());
+
+        std::vector<int64_t> lambda(ref.size());
+        uint32_t n_calls{0};
+        int32_t last{4};
+        correlate(a, b, 5, 290, 600, [&](int32_t offset, int64_t val) {
+            TEST_ASSERT_EQUAL_INT(last + 1, offset);
+            last = offset;
+            lambda[offset - 5] = val;
+            n_calls++;
+        }, engine);
+        TEST_ASSERT_EQUAL_INT(ref.size(), n_calls);
+        TEST_ASSERT_EQUAL_INT64_ARRAY(ref.data(), lambda.data(), ref.size());
+    }
+
+    // Bins, last one partial
+    std::vector<int64_t> ref;
+    correlator::correlate_callback_t f{[&](int32_t /*offset*/, int64_t val) {
+        ref.push_back(val);
+    }};
+    correlate_binned(a, b, 7, 300, 600, 16, f);
+    std::vector<int64_t> out(ref.size());
+    correlate_binned_into(a, b, 7, 300, 600, 16, out.data());
+    TEST_ASSERT_EQUAL_INT64_ARRAY(ref.data(), out.data(), ref.size());
+}
+
+void test_circular_buffer_mirrored() {
+    CircularBuffer cbuf(128, true);
+    int16_t data[128];
+    for (int n = 0; n < 128; n++)
+        data[n] = n;
+
+    cbuf.write(data, 100);
+    cbuf.write(data, 44);
+    TEST_ASSERT_EQUAL(16, cbuf.get_data_ptr());
+
+    // Wrapping region is a single chunk
+    processing_unit_t chunks[2];
+    TEST_ASSERT_EQUAL_INT(1, cbuf.get_data_chunks_c(-31, 16, chunks));
+    TEST_ASSERT_EQUAL_PTR(cbuf.get_data() + 113, chunks[0].start);
+    TEST_ASSERT_EQUAL_INT(16, chunks[0].length);
+    TEST_ASSERT_EQUAL_INT(1, cbuf.get_data_chunks(-128, 128).size());
+
+    const int16_t *p = cbuf.get_window(-44);
+    for (int n = 0; n < 44; n++)
+        TEST_ASSERT_EQUAL_INT(n, p[n]);
+    p = cbuf.get_window(-10);
+    TEST_ASSERT_EQUAL_INT(34, p[0]);
+    TEST_ASSERT_EQUAL_INT(43, p[9]);
+    TEST_ASSERT_EQUAL(43, cbuf.get_max(-20, 20));
+}
+
+void test_correlator_mirrored() {
+    CircularBuffer a(1000);
+    CircularBuffer b(700);
+    CircularBuffer am(1000, true);
+    CircularBuffer bm(700, true);
+
+    srand(9);
+    std::vector<int16_t> data(1700);
+    for (auto &v: data)
+        v = rand() % 4001 - 2000;
+    // Written in pieces, so that copies are updated with and without wrap
+    for (size_t n = 0; n < data.size(); n += 170) {
+        a.write(data.data() + n, 170);
+        am.write(data.data() + n, 170);
+        b.write(data.data() + n, 170);
+        bm.write(data.data() + n, 170);
+    }
+
+    // All offsets with data, and some without
+    const uint32_t ranges[][3] = {{3, 66, 500}, {0, 301, 700}, {280, 420, 600}};
+    for (const auto &r: ranges) {
+        for (auto engine: {CORRELATE_DIRECT, CORRELATE_FFT}) {
+            auto ref = correlate_vec(a, b, r[0], r[1], r[2], engine);
+            auto ret = correlate_vec(am, bm, r[0], r[1], r[2], engine);
+            TEST_ASSERT_EQUAL_INT64_ARRAY(ref.data(), ret.data(), ref.size());
+        }
+        for (uint32_t offset = r[0]; offset < r[1]; offset++)
+            TEST_ASSERT_EQUAL_INT64(correlate_naive(a, b, offset, r[2]),
+                                    correlate_naive(am, bm, offset, r[2]));
+        check_binned(am, bm, r[0], r[1], r[2], 16);
+    }
+    TEST_ASSERT_EQUAL(a.get_max(-900, 900), am.get_max(-900, 900));
+    TEST_ASSERT_EQUAL(a.get_max(-300, 20), am.get_max(-300, 20));
+}
+
+void test_correlator_fused() {
+    CircularBuffer a(1000);
+    CircularBuffer b(1000);
+    CircularBuffer c(900);
+
+    srand(11);
+    // Lockstep writes with wrap
+    std::vector<int16_t> data_a(1700), data_b(1700);
+    for (size_t n = 0; n < data_a.size(); n++) {
+        data_a[n] = rand() % 4001 - 2000;
+        data_b[n] = rand() % 4001 - 2000;
+    }
+    for (size_t n = 0; n < data_a.size(); n += 170) {
+        a.write(data_a.data() + n, 170);
+        b.write(data_b.data() + n, 170);
+    }
+    c.write(data_b.data(), 1700);
+
+    // Odd offset count, offsets out of data
+    const uint32_t ranges[][3] = {{3, 66, 500}, {0, 301, 700}, {280, 421, 600}};
+    for (const auto &r: ranges) {
+        const size_t n = r[1] - r[0];
+        auto aa = correlate_vec(a, a, r[0], r[1], r[2], CORRELATE_DIRECT);
+        auto ab = correlate_vec(a, b, r[0], r[1], r[2], CORRELATE_DIRECT);
+        auto bb = correlate_vec(b, b, r[0], r[1], r[2], CORRELATE_DIRECT);
+        std::vector<int64_t> out_aa(n), out_ab(n), out_bb(n);
+
+        correlate_fused_into(a, b, r[0], r[1], r[2], out_aa.data(), out_ab.data(), out_bb.data());
+        TEST_ASSERT_EQUAL_INT64_ARRAY(aa.data(), out_aa.data(), n);
+        TEST_ASSERT_EQUAL_INT64_ARRAY(ab.data(), out_ab.data(), n);
+        TEST_ASSERT_EQUAL_INT64_ARRAY(bb.data(), out_bb.data(), n);
+
+        std::fill(out_ab.begin(), out_ab.end(), 0);
+        correlate_fused_into(a, b, r[0], r[1], r[2], out_aa.data(), out_ab.data());
+        TEST_ASSERT_EQUAL_INT64_ARRAY(ab.data(), out_ab.data(), n);
+
+        // Not in lockstep
+        auto ac = correlate_vec(a, c, r[0], r[1], r[2], CORRELATE_DIRECT);
+        correlate_fused_into(a, c, r[0], r[1], r[2], out_aa.data(), out_ab.data());
+        TEST_ASSERT_EQUAL_INT64_ARRAY(aa.data(), out_aa.data(), n);
+        TEST_ASSERT_EQUAL_INT64_ARRAY(ac.data(), out_ab.data(), n);
+
+        // Bins
+        const size_t n_bins = (n + 15) / 16;
+        std::vector<int64_t> ref_aa(n_bins), ref_ab(n_bins), ref_bb(n_bins);
+        correlate_binned_into(a, a, r[0], r[1], r[2], 16, ref_aa.data());
+        correlate_binned_into(a, b, r[0], r[1], r[2], 16, ref_ab.data());
+        correlate_binned_into(b, b, r[0], r[1], r[2], 16, ref_bb.data());
+        correlate_fused_binned_into(a, b, r[0], r[1], r[2], 16, out_aa.data(), out_ab.data(), out_bb.data());
+        TEST_ASSERT_EQUAL_INT64_ARRAY(ref_aa.data(), out_aa.data(), n_bins);
+        TEST_ASSERT_EQUAL_INT64_ARRAY(ref_ab.data(), out_ab.data(), n_bins);
+        TEST_ASSERT_EQUAL_INT64_ARRAY(ref_bb.data(), out_bb.data(), n_bins);
+    }
+}
+
+void test_correlator_parallel() {
+    CircularBuffer a(1000);
+    CircularBuffer b(1000);
+
+    srand(12);
+    std::vector<int16_t> data_a(1300), data_b(1300);
+    for (size_t n = 0; n < data_a.size(); n++) {
+        data_a[n] = rand() % 4001 - 2000;
+        data_b[n] = rand() % 4001 - 2000;
+    }
+    a.write(data_a.data(), data_a.size());
+    b.write(data_b.data(), data_b.size());
+
+    SerialExecutor serial;
+    ThreadExecutor threads(2);
+    ThreadExecutor many(7);
+    Executor *executors[] = {&serial, &threads, &many};
+
+    // Ranges shorter than a shard per thread, not aligned to shards or bins
+    const uint32_t ranges[][3] = {{3, 9, 500}, {0, 301, 700}, {17, 421, 600}};
+    for (const auto &r: ranges) {
+        const size_t n = r[1] - r[0];
+        const size_t n_bins = (n + 15) / 16;
+        auto ref = correlate_vec(a, b, r[0], r[1], r[2], CORRELATE_DIRECT);
+        std::vector<int64_t> ref_aa(n_bins), ref_ab(n_bins);
+        correlate_fused_binned_into(a, b, r[0], r[1], r[2], 16, ref_aa.data(), ref_ab.data());
+
+        for (auto e: executors) {
+            std::vector<int64_t> out(n);
+            correlate_into(a, b, r[0], r[1], r[2], out.data(), *e, CORRELATE_DIRECT);
+            TEST_ASSERT_EQUAL_INT64_ARRAY(ref.data(), out.data(), n);
+
+            // Callback is called in offset order
+            std::vector<int64_t> values;
+            correlate_callback_t f([&](int32_t offset, int64_t sum) {
+                TEST_ASSERT_EQUAL(r[0] + values.size(), offset);
+                values.push_back(sum);
+            });
+            correlate(a, b, r[0], r[1], r[2], f, *e, CORRELATE_DIRECT);
+            TEST_ASSERT_EQUAL(n, values.size());
+            TEST_ASSERT_EQUAL_INT64_ARRAY(ref.data(), values.data(), n);
+
+            std::vector<int64_t> bins(n_bins), bins_aa(n_bins), bins_ab(n_bins);
+            correlate_binned_into(a, b, r[0], r[1], r[2], 16, bins.data(), *e);
+            TEST_ASSERT_EQUAL_INT64_ARRAY(ref_ab.data(), bins.data(), n_bins);
+            correlate_fused_binned_into(a, b, r[0], r[1], r[2], 16, bins_aa.data(), bins_ab.data(),
+                                        nullptr, *e);
+            TEST_ASSERT_EQUAL_INT64_ARRAY(ref_aa.data(), bins_aa.data(), n_bins);
+            TEST_ASSERT_EQUAL_INT64_ARRAY(ref_ab.data(), bins_ab.data(), n_bins);
+        }
+    }
+}
+
+void test_correlator_job() {
+    CircularBuffer a(1200);
+    CircularBuffer b(1200);
+
+    srand(13);
+    std::vector<int16_t> data_a(3000), data_b(3000);
+    for (size_t n = 0; n < data_a.size(); n++) {
+        data_a[n] = rand() % 4001 - 2000;
+        data_b[n] = rand() % 4001 - 2000;
+    }
+    a.write(data_a.data(), 1000);
+    b.write(data_b.data(), 1000);
+
+    // Range with a partial last bin and offsets out of data
+    const uint32_t min{5}, max{420}, length{600}, step{16};
+    const size_t n_bins = (max - min + step - 1) / step;
+    std::vector<int64_t> ref_aa(n_bins), ref_ab(n_bins);
+    correlate_fused_binned_into(a, b, min, max, length, step, ref_aa.data(), ref_ab.data());
+
+    CorrelationJob job(a, a, step);
+    TEST_ASSERT_FALSE(job.is_active());
+    job.start(min, max, length, &b);
+    TEST_ASSERT_EQUAL(n_bins, job.get_n_bins());
+
+    // Slices with writes in between, needle stays at the start position
+    size_t pos{1000};
+    size_t n_slices{0};
+    while (!job.step(5)) {
+        a.write(data_a.data() + pos, 30);
+        b.write(data_b.data() + pos, 30);
+        job.advance(30);
+        pos += 30;
+        n_slices++;
+    }
+    TEST_ASSERT_EQUAL((n_bins + 4) / 5 - 1, n_slices);
+    TEST_ASSERT_TRUE(job.is_complete());
+    TEST_ASSERT_EQUAL(0, job.get_restarts());
+    TEST_ASSERT_EQUAL_INT64_ARRAY(ref_aa.data(), job.get_bins(), n_bins);
+    TEST_ASSERT_EQUAL_INT64_ARRAY(ref_ab.data(), job.get_bins_b2(), n_bins);
+
+    // Complete job ignores writes
+    job.advance(1000);
+    TEST_ASSERT_EQUAL_INT64_ARRAY(ref_aa.data(), job.get_bins(), n_bins);
+    job.finish();
+    TEST_ASSERT_FALSE(job.is_active());
+
+    // Bins of b2 extend below the range of a, on the same grid
+    const uint32_t min_aa{min + 2 * step};
+    const size_t n_bins_aa = (max - min_aa + step - 1) / step;
+    correlate_binned_into(a, a, min_aa, max, length, step, ref_aa.data());
+    correlate_binned_into(a, b, min, max, length, step, ref_ab.data());
+    job.start(min_aa, max, length, &b, min - 3);
+    TEST_ASSERT_EQUAL(n_bins_aa, job.get_n_bins());
+    TEST_ASSERT_EQUAL(n_bins, job.get_n_bins_b2());
+    TEST_ASSERT_EQUAL(min, job.get_b2_offset_min());
+    while (!job.step(5))
+        ;
+    TEST_ASSERT_EQUAL_INT64_ARRAY(ref_aa.data(), job.get_bins(), n_bins_aa);
+    TEST_ASSERT_EQUAL_INT64_ARRAY(ref_ab.data(), job.get_bins_b2(), n_bins);
+    job.finish();
+
+    // Buffers overrun during the job, it restarts over the latest samples
+    job.start(min, max, length);
+    job.step(3);
+    a.write(data_a.data() + pos, 200);
+    b.write(data_b.data() + pos, 200);
+    job.advance(200);
+    TEST_ASSERT_EQUAL(1, job.get_restarts());
+    while (!job.step(7))
+        ;
+    correlate_binned_into(a, a, min, max, length, step, ref_aa.data());
+    TEST_ASSERT_EQUAL_INT64_ARRAY(ref_aa.data(), job.get_bins(), n_bins);
+}
+
+template <typename Buffer>
+static void check_compact_buffer(int16_t min, int16_t max) {
+    Buffer buf(100, 2);
+    TEST_ASSERT_EQUAL_INT(128, buf.get_capacity());
+
+    // Wrap, odd positions, saturation and shift
+    std::vector<int16_t> data(300);
+    for (size_t n = 0; n < data.size(); n++)
+        data[n] = (n * 37) % 20001 - 10000;
+    buf.write(data.data(), 151);
+    buf.write(data.data() + 151, 149);
+    TEST_ASSERT_EQUAL_INT(300 % 128, buf.get_data_ptr());
+    for (int n = 1; n <= 128; n++) {
+        const int16_t v = data[300 - n] >> 2;
+        TEST_ASSERT_EQUAL_INT(std::min(std::max(v, min), max), buf.get(-n));
+    }
+}
+
+void test_compact_buffer() {
+    check_compact_buffer<Int8CircularBuffer>(-128, 127);
+    check_compact_buffer<Packed12CircularBuffer>(-2048, 2047);
+    TEST_ASSERT_EQUAL_INT(4096, Int8CircularBuffer(4000).get_storage_size());
+    TEST_ASSERT_EQUAL_INT(6144, Packed12CircularBuffer(4000).get_storage_size());
+}
+
+// Compares compact correlation to a sample buffer holding the stored values
+template <typename Buffer>
+static void check_compact_correlation(uint8_t shift) {
+    Buffer a(1000, shift);
+    Buffer b(600, shift);
+    CircularBuffer ra(a.get_capacity());
+    CircularBuffer rb(b.get_capacity());
+
+    std::vector<int16_t> data(1700);
+    for (auto &v: data)
+        v = rand() % 4001 - 2000;
+    for (size_t n = 0; n < data.size(); n += 170) {
+        a.write(data.data() + n, 170);
+        b.write(data.data() + n, 170);
+    }
+    std::vector<int16_t> stored(a.get_capacity());
+    for (size_t n = 0; n < stored.size(); n++)
+        stored[n] = a.get(n - stored.size());
+    ra.write(stored.data(), stored.size());
+    stored.resize(b.get_capacity());
+    for (size_t n = 0; n < stored.size(); n++)
+        stored[n] = b.get(n - stored.size());
+    rb.write(stored.data(), stored.size());
+
+    // Offsets past the haystack, partial lag blocks
+    const uint32_t ranges[][3] = {{0, 66, 500}, {3, 302, 512}, {500, 530, 512}};
+    for (const auto &r: ranges) {
+        std::vector<int64_t> out(r[1] - r[0]);
+        correlate_into(a, b, r[0], r[1], r[2], out.data());
+        for (uint32_t offset = r[0]; offset < r[1]; offset++)
+            TEST_ASSERT_EQUAL_INT64(correlate_naive(ra, rb, offset, r[2]), out[offset - r[0]]);
+    }
+}
+
+void test_correlator_compact() {
+    srand(10);
+    check_compact_correlation<Int8CircularBuffer>(4);
+    check_compact_correlation<Int8CircularBuffer>(0);
+    check_compact_correlation<Packed12CircularBuffer>(0);
+}
+
+void test_binary_buffer() {
+    BinaryCircularBuffer buf(100, 10);
+    int16_t data[40];
+
+    // Rounded up to words
+    TEST_ASSERT_EQUAL(128, buf.get_capacity());
+    for (size_t n = 0; n < 40; n++)
+        data[n] = (n % 3) ? 10 : 9;
+    buf.write(data, 40);
+    TEST_ASSERT_EQUAL(40, buf.get_data_ptr());
+    // Samples 8..39: bit set when n % 3 != 0
+    uint32_t expected{0};
+    for (size_t n = 0; n < 32; n++)
+        if ((n + 8) % 3)
+            expected |= 1UL << n;
+    TEST_ASSERT_EQUAL_UINT32(expected, buf.get_word(-32));
+
+    // Wrap
+    buf.write(data, 40);
+    buf.write(data, 40);
+    buf.write(data, 40);
+    TEST_ASSERT_EQUAL(32, buf.get_data_ptr());
+    TEST_ASSERT_EQUAL_UINT32(expected, buf.get_word(-32));
+    TEST_ASSERT_EQUAL_UINT32(expected, buf.get_word(-72));
+}
+
+void test_correlator_binary() {
+    const int16_t threshold = 500;
+    BinaryCircularBuffer a_bin(640, threshold);
+    BinaryCircularBuffer b_bin(320, threshold);
+    CircularBuffer a(640);
+    CircularBuffer b(320);
+    int16_t data[37];
+
+    // Same data, thresholded to 0/1, in sample buffers for reference
+    srand(5);
+    for (size_t block = 0; block < 40; block++) {
+        int16_t ones[37];
+        for (size_t n = 0; n < 37; n++) {
+            data[n] = rand() % 1000;
+            ones[n] = data[n] >= threshold;
+        }
+        a_bin.write(data, 37);
+        a.write(ones, 37);
+        if (block % 2) {
+            b_bin.write(data, 37);
+            b.write(ones, 37);
+        }
+    }
+
+    const uint32_t ranges[][3] = {
+        {0, 40, 256}, {3, 77, 301}, {300, 400, 300}, {1, 2, 5}
+    };
+    for (const auto &r: ranges) {
+        auto direct = correlate_vec(a, b, r[0], r[1], r[2], CORRELATE_DIRECT);
+        correlator::correlate_callback_t f{[&](int32_t offset, int64_t val) {
+            TEST_ASSERT_EQUAL_INT64(direct[offset - r[0]], val);
+        }};
+        correlate_binary(a_bin, b_bin, r[0], r[1], r[2], f);
+
+        size_t n_bins{0};
+        correlator::correlate_callback_t fb{[&](int32_t offset, int64_t val) {
+            int64_t expected{0};
+            for (uint32_t n = offset; n < std::min<uint32_t>(offset + 16, r[1]); n++)
+                expected += direct[n - r[0]];
+            TEST_ASSERT_EQUAL_INT64(expected, val);
+            n_bins++;
+        }};
+        correlate_binary_binned(a_bin, b_bin, r[0], r[1], r[2], 16, fb);
+        TEST_ASSERT_EQUAL_INT((r[1] - r[0] + 15) / 16, n_bins);
+    }
+}
+
 int main(int argc, char **argv) {
     UNITY_BEGIN();
 
     RUN_TEST(test_circular_buffer_fill);
     RUN_TEST(test_circular_buffer_chunks);
+    RUN_TEST(test_circular_buffer_wrap);
+    RUN_TEST(test_circular_buffer_view);
     RUN_TEST(test_break_chunks);
     RUN_TEST(test_correlator);
+    RUN_TEST(test_correlator_engine_select);
+    RUN_TEST(test_correlator_fft);
+    RUN_TEST(test_correlator_fft_no_data);
+    RUN_TEST(test_correlator_max_exact);
+    RUN_TEST(test_correlator_lag_block);
+    RUN_TEST(test_sliding_correlator);
+    RUN_TEST(test_correlator_binned);
+    RUN_TEST(test_circular_buffer_summary);
+    RUN_TEST(test_correlator_sparse);
+    RUN_TEST(test_active_window_length);
+    RUN_TEST(test_correlator_max_bounded);
+    RUN_TEST(test_correlator_coarse_fine);
+    RUN_TEST(test_correlator_into);
+    RUN_TEST(test_circular_buffer_mirrored);
+    RUN_TEST(test_correlator_mirrored);
+    RUN_TEST(test_correlator_fused);
+    RUN_TEST(test_correlator_parallel);
+    RUN_TEST(test_correlator_job);
+    RUN_TEST(test_compact_buffer);
+    RUN_TEST(test_correlator_compact);
+    RUN_TEST(test_binary_buffer);
+    RUN_TEST(test_correlator_binary);
  
     UNITY_END();
 }
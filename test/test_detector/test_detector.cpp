@@ -2,6 +2,7 @@
 #include <vector>
 #include "filter.h"
 #include "detector.h"
+#include "detector_stage.h"
 
 std::vector<int16_t> test_input = {
 183,   178,   178,   175,   175,   177,   176,   178,   179,   174,   172,   177,   178,   172,   171,   170,  // b[0]
@@ -255,10 +256,67 @@ void test_dc_filter_and_detector() {
     TEST_ASSERT_EQUAL(1976 - 1964, det.results[3].len);
 }
 
+// Fused FIR -> DC block -> detector stage against the separate stages
+static void check_fir_dc_detect(size_t decimation) {
+    auto data = test_input.data();
+    auto data_len = test_input.size();
+    const std::vector<float> lowpass{0.0625, 0.25, 0.375, 0.25, 0.0625};
+
+    filter::FIRFilter fir(lowpass, decimation);
+    filter::DCBlockFilter dc;
+    ObjectDetector det(8, 10);
+    filter::FIRFilter fused_fir(lowpass, decimation);
+    filter::DCBlockFilter fused_dc;
+    ObjectDetector fused_det(8, 10);
+    dc.preinit(data[0]);
+    fused_dc.preinit(data[0]);
+
+    std::vector<int16_t> out, fused_out(data_len);
+    size_t fused_len{0};
+    for (size_t n = 0; n < data_len; n += 32) {
+        size_t to_write = std::min<size_t>(data_len - n, 32);
+        fir.write(data + n, to_write);
+        dc.write(fir.out_buf(), fir.out_len());
+        fir.consume(fir.out_len());
+        auto dc_len = dc.out_len();
+        out.insert(out.end(), dc.out_buf(), dc.out_buf() + dc_len);
+        det.write(dc.out_buf(), dc_len);
+        dc.consume(dc_len);
+
+        // Odd chunks are not stored
+        int16_t *fused_dst = (n / 32) & 1 ? nullptr : fused_out.data() + fused_len;
+        size_t len = fir_dc_detect(fused_fir, fused_dc, fused_det, data + n, to_write, fused_dst);
+        if (!fused_dst)
+            std::copy(out.end() - len, out.end(), fused_out.begin() + fused_len);
+        fused_len += len;
+    }
+
+    // Nothing is queued without taps
+    TEST_ASSERT_EQUAL(0, fused_fir.out_len());
+    TEST_ASSERT_EQUAL(0, fused_dc.out_len());
+    TEST_ASSERT_EQUAL(out.size(), fused_len);
+    TEST_ASSERT_EQUAL_INT16_ARRAY(out.data(), fused_out.data(), fused_len);
+    TEST_ASSERT_EQUAL(det.get_timestamp(), fused_det.get_timestamp());
+    TEST_ASSERT_TRUE(det.results.size() > 0);
+    TEST_ASSERT_EQUAL(det.results.size(), fused_det.results.size());
+    for (size_t n = 0; n < det.results.size(); n++) {
+        TEST_ASSERT_EQUAL(det.results[n].start, fused_det.results[n].start);
+        TEST_ASSERT_EQUAL(det.results[n].len, fused_det.results[n].len);
+        TEST_ASSERT_EQUAL(det.results[n].power, fused_det.results[n].power);
+        TEST_ASSERT_EQUAL(det.results[n].ampl, fused_det.results[n].ampl);
+    }
+}
+
+void test_fir_dc_detect() {
+    check_fir_dc_detect(1);
+    check_fir_dc_detect(3);
+}
+
 int main(int argc, char **argv) {
     UNITY_BEGIN();
 
     RUN_TEST(test_dc_filter_and_detector);
+    RUN_TEST(test_fir_dc_detect);
  
     UNITY_END();
 }
@@ -1,6 +1,10 @@
 #include <unity.h>
 #include "filter.h"
+#include "pipeline.h"
 #include <vector>
+#include <string.h>
+#include <algorithm>
+#include <math.h>
 #include <iostream>
 
 // FIR low pass filter with Hamming window (fiiir.com)
@@ -199,6 +203,314 @@ void test_fir_filter_decimate() {
     TEST_ASSERT_TRUE(nearly_equal(out[4], input_one_level));
 }
 
+void test_fir_filter_impulse() {
+    // Even and odd length, symmetric and not
+    const std::vector<std::vector<float>> filters{
+        {0.125, 0.25, 0.5, 0.25, 0.125},
+        {0.125, 0.25, 0.5, 0.5, 0.25, 0.125},
+        {0.5, 0.25, 0.125, -0.125},
+    };
+    for (const auto &coeff: filters) {
+        filter::FIRFilter filter(coeff, 1);
+        // Impulses repeat over many history wraps
+        const size_t period = coeff.size() + 3;
+        int16_t data[100] = {0};
+        for (size_t n = 0; n < 100; n += period)
+            data[n] = 4096;
+        filter.write(data, 100);
+        TEST_ASSERT_EQUAL_INT(100, filter.out_len());
+        int16_t out[100];
+        TEST_ASSERT_EQUAL_INT(100, filter.read(out, 100));
+        for (size_t n = 0; n < 100; n++) {
+            const size_t phase = n % period;
+            const int16_t expected = (phase < coeff.size()) ? coeff[phase] * 4096 : 0;
+            TEST_ASSERT_EQUAL_INT(expected, out[n]);
+        }
+    }
+}
+
+static constexpr std::array<float, 17> hamming_1000_200_200_c {
+    -0.001873, 0.003077, 0.010843, -0.000000, -0.040902, -0.044693, 0.081012, 0.292371,
+    0.400330,
+    0.292371, 0.081012, -0.044693, -0.040902, -0.000000, 0.010843, 0.003077, -0.001873
+};
+
+static constexpr std::array<float, 6> asymmetric_c {
+    0.5, 0.25, 0.125, -0.125, 0.0625, 0.03125
+};
+
+template <typename Static>
+static void check_static_fir_filter(const std::vector<float> &coeff) {
+    Static static_filter;
+    filter::FIRFilter filter(coeff, 3);
+    TEST_ASSERT_EQUAL(filter.is_symmetric(), Static::is_symmetric());
+
+    srand(1);
+    int16_t data[200];
+    for (size_t n = 0; n < 200; n++)
+        data[n] = rand() % 8001 - 4000;
+    // Odd write lengths and strided input
+    for (size_t n = 0; n < 150; n += 25) {
+        static_filter.write(data + n, 25);
+        filter.write(data + n, 25);
+    }
+    static_filter.write(data + 1, 50, 2);
+    filter.write(data + 1, 50, 2);
+
+    TEST_ASSERT_EQUAL_INT(filter.out_len(), static_filter.out_len());
+    int16_t out[128], static_out[128];
+    const size_t n = filter.read(out, 128);
+    TEST_ASSERT_EQUAL_INT(n, static_filter.read(static_out, 128));
+    TEST_ASSERT_EQUAL_INT16_ARRAY(out, static_out, n);
+}
+
+void test_static_fir_filter() {
+    check_static_fir_filter<filter::StaticFIRFilter<17, 3, 12, hamming_1000_200_200_c>>(hamming_1000_200_200);
+    check_static_fir_filter<filter::StaticFIRFilter<6, 3, 12, asymmetric_c>>(
+        std::vector<float>(asymmetric_c.begin(), asymmetric_c.end()));
+    TEST_ASSERT_EQUAL(-8, filter::fir_quantize(-0.001873, 12));
+    TEST_ASSERT_EQUAL(1640, filter::fir_quantize(0.400330, 12));
+}
+
+void test_filter_output_ring() {
+    // Identity filter, output equals input
+    filter::FIRFilter filter({1.0}, 1);
+    int16_t data[100];
+    int16_t next{0};      // next value to write
+    int16_t expected{0};  // next value to read
+
+    // Partial consumes move the queue over the ring end
+    for (size_t round = 0; round < 5; round++) {
+        for (size_t n = 0; n < 100; n++)
+            data[n] = next++;
+        filter.write(data, 100);
+        filter.consume(70);
+        expected += 70;
+        TEST_ASSERT_EQUAL_INT(next - expected, filter.out_len());
+
+        filter::filter_span_t spans[2];
+        const size_t n_spans = filter.peek(spans, filter.out_len());
+        TEST_ASSERT_TRUE(n_spans >= 1 && n_spans <= 2);
+        int16_t value = expected;
+        for (size_t n = 0; n < n_spans; n++)
+            for (size_t m = 0; m < spans[n].length; m++)
+                TEST_ASSERT_EQUAL_INT(value++, spans[n].data[m]);
+        TEST_ASSERT_EQUAL_INT(next, value);
+        // Peek does not consume
+        TEST_ASSERT_EQUAL_INT(next - expected, filter.out_len());
+
+        int16_t out[30];
+        TEST_ASSERT_EQUAL_INT(30, filter.read(out, 30));
+        for (size_t n = 0; n < 30; n++)
+            TEST_ASSERT_EQUAL_INT(expected++, out[n]);
+    }
+
+    // Queue which wraps is made contiguous by out_buf()
+    for (size_t n = 0; n < 100; n++)
+        data[n] = next++;
+    filter.write(data, 100);
+    filter.consume(5);
+    expected += 5;
+    filter::filter_span_t spans[2];
+    TEST_ASSERT_EQUAL_INT(2, filter.peek(spans));
+    const int16_t *out = filter.out_buf();
+    for (size_t n = 0; n < filter.out_len(); n++)
+        TEST_ASSERT_EQUAL_INT(expected + n, out[n]);
+    TEST_ASSERT_EQUAL_INT(1, filter.peek(spans));
+
+    // Full queue drops new values
+    filter.write(data, 100);
+    TEST_ASSERT_EQUAL_INT(filter::FILTER_OUTPUT_LEN, filter.out_len());
+    TEST_ASSERT_EQUAL_INT(67, filter.overflow_cnt);
+}
+
+// Half-band lowpass, Kaiser window beta = 6, stopband from 0.4 fs
+static constexpr std::array<float, 15> half_band_15_c {
+    -0.000676, 0.000000, 0.012712, 0.000000, -0.062710, 0.000000, 0.300794,
+    0.499759,
+    0.300794, 0.000000, -0.062710, 0.000000, 0.012712, 0.000000, -0.000676
+};
+
+void test_half_band_filter() {
+    using HalfBand = filter::HalfBandFilter<15, 12, half_band_15_c>;
+    static_assert(HalfBand::MACS == 5);
+    static_assert(filter::Pipeline<filter::CICFilter<4,5>, HalfBand>::DECIMATION == 10);
+
+    // Same output as the generic filter
+    HalfBand half_band;
+    filter::FIRFilter filter(std::vector<float>(half_band_15_c.begin(), half_band_15_c.end()), 2);
+    srand(4);
+    int16_t data[200];
+    for (size_t n = 0; n < 200; n++)
+        data[n] = rand() % 8001 - 4000;
+    for (size_t n = 0; n < 150; n += 25) {
+        half_band.write(data + n, 25);
+        filter.write(data + n, 25);
+    }
+    half_band.write(data + 1, 50, 2);
+    filter.write(data + 1, 50, 2);
+
+    TEST_ASSERT_EQUAL_INT(filter.out_len(), half_band.out_len());
+    int16_t out[128], half_band_out[128];
+    size_t n_out = filter.read(out, 128);
+    TEST_ASSERT_EQUAL_INT(n_out, half_band.read(half_band_out, 128));
+    TEST_ASSERT_EQUAL_INT16_ARRAY(out, half_band_out, n_out);
+
+    // Passband: DC passes with unity gain
+    HalfBand dc;
+    int16_t level[64];
+    for (size_t n = 0; n < 64; n++)
+        level[n] = input_one_level;
+    dc.write(level, 64);
+    n_out = dc.read(out, 128);
+    TEST_ASSERT_EQUAL_INT(32, n_out);
+    for (size_t n = 8; n < n_out; n++)
+        TEST_ASSERT_TRUE(nearly_equal(input_one_level, out[n]));
+
+    // Stopband: 0.45 fs is attenuated by more than 55dB
+    HalfBand stop;
+    int16_t tone[256];
+    for (size_t n = 0; n < 256; n++)
+        tone[n] = 8000 * cos(2 * M_PI * 0.45 * n);
+    stop.write(tone, 256);
+    n_out = stop.read(out, 128);
+    for (size_t n = 8; n < n_out; n++)
+        TEST_ASSERT_INT_WITHIN(14, 0, out[n]);
+}
+
+// 4th order Butterworth lowpass, 5kHz at 50ksps
+static std::vector<filter::biquad_coefficients_t> butterworth_50k_5k {
+    {0.06188520, 0.12377039, 0.06188520, -1.04859958, 0.29614036},
+    {0.07795634, 0.15591268, 0.07795634, -1.32091344, 0.63273880},
+};
+
+// Floating point direct form I reference
+static std::vector<float> biquad_reference(const std::vector<filter::biquad_coefficients_t> &sections,
+                                           const std::vector<int16_t> &data) {
+    std::vector<float> out(data.begin(), data.end());
+    for (const auto &c: sections) {
+        float x1{0}, x2{0}, y1{0}, y2{0};
+        for (auto &v: out) {
+            float y = c.b0 * v + c.b1 * x1 + c.b2 * x2 - c.a1 * y1 - c.a2 * y2;
+            x2 = x1; x1 = v;
+            y2 = y1; y1 = y;
+            v = y;
+        }
+    }
+    return out;
+}
+
+void test_biquad_filter_step() {
+    filter::BiquadCascadeFilter filter(butterworth_50k_5k);
+    std::vector<int16_t> data(120, input_one_level);
+    auto expected = biquad_reference(butterworth_50k_5k, data);
+
+    // Write in chunks to make sure write() is working well with multiple calls
+    int16_t out[120];
+    size_t n_out{0};
+    for (size_t n = 0; n < data.size(); n += 40) {
+        filter.write(data.data() + n, 40);
+        n_out += filter.read(out + n_out, 120 - n_out);
+    }
+    TEST_ASSERT_EQUAL_INT(120, n_out);
+
+    for (size_t n = 0; n < n_out; n++)
+        TEST_ASSERT_INT_WITHIN(3, (int)lroundf(expected[n]), out[n]);
+    // Butterworth step response overshoots by about 11%, then settles
+    TEST_ASSERT_TRUE(*std::max_element(out, out + n_out) < input_one_level * 1.15);
+    TEST_ASSERT_TRUE(nearly_equal(input_one_level, out[n_out - 1]));
+}
+
+void test_biquad_filter_stability() {
+    // Full scale input at the resonance of a high-Q section
+    const float w0 = 2 * M_PI * 0.05, alpha = sin(w0) / (2 * 20);
+    const float a0 = 1 + alpha;
+    std::vector<filter::biquad_coefficients_t> resonant{
+        {(1 - cos(w0)) / 2 / a0, (1 - cos(w0)) / a0, (1 - cos(w0)) / 2 / a0,
+         -2 * cos(w0) / a0, (1 - alpha) / a0},
+    };
+    resonant.insert(resonant.end(), butterworth_50k_5k.begin(), butterworth_50k_5k.end());
+    filter::BiquadCascadeFilter filter(resonant, 3);
+    TEST_ASSERT_EQUAL_INT(3, filter.get_n_sections());
+
+    int16_t data[120], out[128];
+    for (size_t n = 0; n < 120; n++)
+        data[n] = (n % 20 < 10) ? INT16_MAX : INT16_MIN;
+    for (size_t n = 0; n < 20; n++) {
+        filter.write(data, 120);
+        TEST_ASSERT_EQUAL_INT(40, filter.read(out, 128));
+    }
+    TEST_ASSERT_EQUAL(0, filter.overflow_cnt);
+
+    // Decays to zero without limit cycles once the input is removed
+    memset(data, 0, sizeof(data));
+    for (size_t n = 0; n < 100; n++) {
+        filter.write(data, 120);
+        filter.read(out, 128);
+    }
+    for (size_t n = 0; n < 40; n++)
+        TEST_ASSERT_INT_WITHIN(1, 0, out[n]);
+}
+
+void test_biquad_filter_range() {
+    // Poles close to DC, a1 close to -2. Coefficients are exact in 14 fractional bits
+    constexpr float q{1 << filter::BIQUAD_COEFF_SHIFT};
+    std::vector<filter::biquad_coefficients_t> resonant{
+        {16 / q, 32 / q, 16 / q, -32700 / q, 16340 / q},
+    };
+    // First-order coefficient above 2, as of a section with gain
+    std::vector<filter::biquad_coefficients_t> gain{
+        {0.25, 2.5, 0.25, 0, 0},
+    };
+    for (const auto &sections: {resonant, gain}) {
+        filter::BiquadCascadeFilter filter(sections);
+        std::vector<int16_t> data(1000);
+        for (size_t n = 0; n < data.size(); n++)
+            data[n] = (n < 500) ? 1000 : -500;
+        auto expected = biquad_reference(sections, data);
+
+        int16_t out[100];
+        for (size_t n = 0; n < data.size(); n += 100) {
+            filter.write(data.data() + n, 100);
+            TEST_ASSERT_EQUAL_INT(100, filter.read(out, 100));
+            for (size_t k = 0; k < 100; k++)
+                TEST_ASSERT_INT_WITHIN(2, (int)lroundf(expected[n + k]), out[k]);
+        }
+    }
+
+    // Coefficients out of range are clamped to just below 4
+    filter::BiquadCascadeFilter clamped({{0, 5.0, 0, 0, 0}});
+    int16_t impulse[2]{1000, 0}, out[2];
+    clamped.write(impulse, 2);
+    TEST_ASSERT_EQUAL_INT(2, clamped.read(out, 2));
+    TEST_ASSERT_EQUAL_INT16(0, out[0]);
+    TEST_ASSERT_EQUAL_INT16(1000 * filter::BIQUAD_COEFF_MAX >> filter::BIQUAD_COEFF_SHIFT, out[1]);
+}
+
+void test_biquad_filter_decimate() {
+    filter::BiquadCascadeFilter filter(butterworth_50k_5k);
+    filter::BiquadCascadeFilter filter_decimated(butterworth_50k_5k, 3);
+
+    srand(5);
+    int16_t data[96];
+    for (size_t n = 0; n < 96; n++)
+        data[n] = rand() % 8001 - 4000;
+    filter.write(data, 96);
+    // Strided input, as for interleaved channels
+    int16_t data_interleaved[192];
+    for (size_t n = 0; n < 96; n++) {
+        data_interleaved[2*n] = data[n];
+        data_interleaved[2*n + 1] = 0;
+    }
+    filter_decimated.write(data_interleaved, 192, 2);
+
+    int16_t out[96], out_decimated[32];
+    TEST_ASSERT_EQUAL_INT(96, filter.read(out, 96));
+    TEST_ASSERT_EQUAL_INT(32, filter_decimated.read(out_decimated, 32));
+    for (size_t n = 0; n < 32; n++)
+        TEST_ASSERT_EQUAL_INT16(out[3*n], out_decimated[n]);
+}
+
 static std::vector<float> cic_impulse_response_M4_R5 = {
     /* 0.0016, 0.0064, 0.016,  0.032, */  0.056, 
     /* 0.0832, 0.1088, 0.128,  0.136, */  0.128,
@@ -236,6 +548,86 @@ void test_cic_filter_response() {
     }
 }
 
+void test_cic_filter_interleaved() {
+    filter::InterleavedCICFilter<4,5,2> filter;
+    filter::CICFilter<4,5> filter_a;
+    filter::CICFilter<4,5> filter_b;
+
+    TEST_ASSERT_EQUAL_FLOAT(filter_a.gain(), filter.gain());
+
+    srand(2);
+    int16_t data[256];
+    for (size_t n = 0; n < 256; n++)
+        data[n] = rand() % 4001 - 2000;
+
+    // Writes not aligned to the decimation
+    for (size_t n = 0; n < 256; n += 64) {
+        filter.write(data + n, 64);
+        filter_a.write(data + n, 64, 2);
+        filter_b.write(data + n + 1, 64, 2);
+    }
+
+    auto &out_a = filter.channel(0);
+    auto &out_b = filter.channel(1);
+    TEST_ASSERT_EQUAL_INT(filter_a.out_len(), out_a.out_len());
+    TEST_ASSERT_EQUAL_INT(filter_b.out_len(), out_b.out_len());
+    TEST_ASSERT_EQUAL_INT16_ARRAY(filter_a.out_buf(), out_a.out_buf(), out_a.out_len());
+    TEST_ASSERT_EQUAL_INT16_ARRAY(filter_b.out_buf(), out_b.out_buf(), out_b.out_len());
+
+    // Channels are consumed independently
+    out_a.consume(5);
+    TEST_ASSERT_EQUAL_INT(filter_b.out_len() - 5, out_a.out_len());
+    TEST_ASSERT_EQUAL_INT(filter_b.out_len(), out_b.out_len());
+}
+
+// Sink stage collecting its input
+struct pipeline_sink_t {
+    std::vector<int16_t> data;
+    void write(const int16_t *d, size_t length) { data.insert(data.end(), d, d + length); }
+};
+
+void test_filter_pipeline() {
+    using Pipeline = filter::Pipeline<filter::CICFilter<4,5>,
+                                      filter::StaticFIRFilter<17, 3, 12, hamming_1000_200_200_c>,
+                                      filter::DCBlockFilter,
+                                      pipeline_sink_t>;
+    static_assert(Pipeline::DECIMATION == 15);
+    static_assert(Pipeline::BLOCK_LEN == 5 * (filter::FILTER_OUTPUT_LEN - 3 * filter::PIPELINE_MIN_DRAIN));
+
+    Pipeline pipeline;
+    filter::CICFilter<4,5> cic;
+    filter::StaticFIRFilter<17, 3, 12, hamming_1000_200_200_c> fir;
+    filter::DCBlockFilter dc;
+    std::vector<int16_t> expected;
+
+    srand(3);
+    std::vector<int16_t> data(3000);
+    for (auto &d: data)
+        d = rand() % 4001 - 2000;
+
+    // Writes longer than a pipeline block, and not aligned to the decimation
+    for (size_t n = 0; n < data.size(); n += 1000) {
+        pipeline.write(data.data() + n, 1000);
+        for (size_t k = n; k < n + 1000; k += 100) {
+            cic.write(data.data() + k, 100);
+            fir.write(cic.out_buf(), cic.out_len());
+            cic.consume(cic.out_len());
+            dc.write(fir.out_buf(), fir.out_len());
+            fir.consume(fir.out_len());
+            expected.insert(expected.end(), dc.out_buf(), dc.out_buf() + dc.out_len());
+            dc.consume(dc.out_len());
+        }
+    }
+
+    // Stages hold short outputs until flushed
+    pipeline.flush();
+    auto &sink = pipeline.last();
+    TEST_ASSERT_EQUAL_INT(data.size() / 15, sink.data.size());
+    TEST_ASSERT_EQUAL_INT(expected.size(), sink.data.size());
+    TEST_ASSERT_EQUAL_INT16_ARRAY(expected.data(), sink.data.data(), expected.size());
+    TEST_ASSERT_EQUAL_INT(0, pipeline.stage<0>().out_len());
+}
+
 void test_cic_filter_response_c() {
     cic_filter_t filter;
     cic_init(&filter, 4, 5);
@@ -274,7 +666,17 @@ int main(int argc, char **argv) {
     RUN_TEST(test_fir_filter_asymmetric);
     RUN_TEST(test_fir_filter_interleave);
     RUN_TEST(test_fir_filter_decimate);
+    RUN_TEST(test_fir_filter_impulse);
+    RUN_TEST(test_static_fir_filter);
+    RUN_TEST(test_filter_output_ring);
+    RUN_TEST(test_half_band_filter);
+    RUN_TEST(test_biquad_filter_step);
+    RUN_TEST(test_biquad_filter_stability);
+    RUN_TEST(test_biquad_filter_decimate);
+    RUN_TEST(test_biquad_filter_range);
     RUN_TEST(test_cic_filter_response);
+    RUN_TEST(test_cic_filter_interleaved);
+    RUN_TEST(test_filter_pipeline);
     RUN_TEST(test_cic_filter_response_c);
 
     UNITY_END();